@@ -2,16 +2,21 @@
 
 #include "BBox3D.h"
 #include "Node.h"
+#include "Tool.h"
 #include "Vector3D.h"
 
 #include <algorithm>
 #include <array>
-#include <bitset>
+#include <bit>
 #include <cmath>
 #include <cstdint>
-#include <execution>
+#include <cstring>
 #include <functional>
 #include <memory>
+#include <span>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 class Voxel {
@@ -24,11 +29,11 @@ public:
     {
         return (float)edgeLength() / (float)halfRootEdgeLength;
     }
-    static Vector3D<uint32_t> getCoord(uint32_t index)
+    static Vector3D<uint32_t> getCoord(uint64_t index)
     {
-        return Morton::decode((uint64_t)(index));
+        return Morton::decode(index);
     }
-    static Vector3D<float> getCoordGL(uint32_t index, uint32_t halfRootEdgeLength)
+    static Vector3D<float> getCoordGL(uint64_t index, uint32_t halfRootEdgeLength)
     {
         Vector3D<uint32_t> coord = getCoord(index);
         return {
@@ -37,14 +42,79 @@ public:
             ((float)coord.z + 0.5f) / (float)halfRootEdgeLength - 1.0f
         };
     }
+
+    // Offset along axis (0 = x, 1 = y, 2 = z) of the j-th voxel of a 64-voxel word inside its 4x4x4 block.
+    static constexpr uint32_t blockOffset(uint32_t j, uint32_t axis)
+    {
+        uint32_t shift = 2 - axis;
+        return ((j >> shift) & 1) | (((j >> (shift + 3)) & 1) << 1);
+    }
+
+    // Writes the centers of the 64 voxels of the word starting at Morton index `index` as separate x, y and z arrays.
+    static void getBlockCoordGL(uint64_t index, uint32_t halfRootEdgeLength, float* x, float* y, float* z)
+    {
+        Vector3D<uint32_t> coord = getCoord(index);
+        const float scale = 1.0f / (float)halfRootEdgeLength;
+        for (uint32_t j = 0; j < 64; ++j) {
+            x[j] = ((float)(coord.x + blockOffset(j, 0)) + 0.5f) * scale - 1.0f;
+            y[j] = ((float)(coord.y + blockOffset(j, 1)) + 0.5f) * scale - 1.0f;
+            z[j] = ((float)(coord.z + blockOffset(j, 2)) + 0.5f) * scale - 1.0f;
+        }
+    }
 };
 
+// How a subdivided brick keeps its voxels: every word, the voxels that differ from an all
+// active or all inactive fill, or the indices where runs of active and inactive voxels
+// start in Morton order. A solid tile or an empty brick keeps none.
+enum class BrickEncoding : uint8_t {
+    Dense,
+    Sparse,
+    Runs,
+};
+
+// The bricks of a tree by what they keep, and the bytes they take with their voxels.
+struct BrickStorageStats {
+    uint64_t tiles = 0;
+    uint64_t inactive = 0;
+    uint64_t dense = 0;
+    uint64_t sparse = 0;
+    uint64_t runs = 0;
+    uint64_t bytes = 0;
+};
+
+// A brick is the smallest unit of parallel work: its word loops run serially inside
+// the scheduler task that reached it. Its voxels live out of line, so a tile costs only
+// the node, and a brick left alone for a step may switch to a compact encoding.
 template <uint32_t N>
 class Brick : public Node<Voxel, N> {
+    static_assert(N >= 2, "a brick must hold at least one 64-bit word of voxels");
+    static_assert(N <= 5, "compact encodings index voxels with 16 bits");
+
 public:
     Brick() = default;
     ~Brick() = default;
 
+    Brick(const Brick& other)
+        : Node<Voxel, N>(other)
+        , encoding(other.encoding)
+        , sparseFill(other.sparseFill)
+        , isWarm(other.isWarm)
+        , codeCount(other.codeCount)
+        , wordMask(other.wordMask)
+    {
+        if (other.dense != nullptr) {
+            dense = std::make_unique<WordArray>(*other.dense);
+        }
+        if (other.codes != nullptr) {
+            codes = std::make_unique<uint16_t[]>(codeCount);
+            std::copy_n(other.codes.get(), codeCount, codes.get());
+        }
+    }
+
+    Brick& operator=(const Brick&) = delete;
+
+    static constexpr uint32_t wordCount() { return Node<Voxel, N>::maxChildrenCount() / bitLength; }
+
     void initialize(const BBox3D<float>& bbox, const uint32_t halfRootEdgeLength)
     {
         this->reset();
@@ -56,91 +126,1015 @@ public:
             return;
         }
         this->subdivide();
-        std::for_each(std::execution::par, this->voxels.begin(), this->voxels.end(), [&](auto& v) {
-            uint32_t i = &v - voxels.data();
-            v = std::make_unique<std::bitset<bitLength>>(0xffff'ffff'ffff'ffff);
-            for (uint32_t j = 0; j < bitLength; ++j) {
-                if (v->test(j)) {
-                    uint64_t index = this->calChildId(i * bitLength + j);
-                    if (!bbox.isInside(Voxel::getCoordGL(index, halfRootEdgeLength))) {
-                        v->reset(j);
-                    }
+        std::for_each(words().begin(), words().end(), [&](uint64_t& w) {
+            uint32_t i = &w - words().data();
+            for (uint64_t bits = w; bits != 0; bits &= bits - 1) {
+                uint32_t j = std::countr_zero(bits);
+                uint64_t index = this->calChildId(i * bitLength + j);
+                if (!bbox.isInside(Voxel::getCoordGL(index, halfRootEdgeLength))) {
+                    w &= ~(1ull << j);
                 }
             }
         });
+        updateWordMask();
     }
 
     void reset()
     {
-        for (auto& voxel : voxels) {
-            voxel.reset();
-        }
         this->isActive = true;
         this->hasChildren = false;
+        this->isDirty = true;
+        this->counted = ActiveVoxels::cube(this->getOrigin(), this->edgeLength());
+        dense.reset();
+        codes.reset();
+        codeCount = 0;
+        encoding = BrickEncoding::Dense;
     }
 
     void subdivide()
     {
         this->hasChildren = true;
-        std::for_each(std::execution::par, voxels.begin(), voxels.end(), [&](auto& v) {
-            v = std::make_unique<std::bitset<bitLength>>(0xffff'ffff'ffff'ffff);
-        });
+        isWarm = true;
+        codes.reset();
+        codeCount = 0;
+        encoding = BrickEncoding::Dense;
+        if (dense == nullptr) {
+            dense = std::make_unique<WordArray>();
+        }
+        words().fill(~0ull);
+        wordMask.fill(~0ull);
+        if constexpr (wordCount() % bitLength != 0) {
+            wordMask.back() = (1ull << (wordCount() % bitLength)) - 1;
+        }
+        this->counted = ActiveVoxels::cube(this->getOrigin(), this->edgeLength());
     }
 
-    void subtract(const BBox3D<float>& bbox, const std::function<bool(const Vector3D<float>&)>& isInside, const uint32_t halfRootEdgeLength)
+    void subtract(const BBox3D<float>& bbox, const std::function<bool(const Vector3D<float>&)>& isInside, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
     {
         if (!bbox.intersects(this->getBBoxGL(halfRootEdgeLength))) {
             return;
         }
+        this->isDirty = true;
         if (!this->hasChildren) {
             this->subdivide();
+        } else {
+            expand();
+        }
+        WordArray was;
+        if (tally != nullptr) {
+            was = words();
+        }
+        std::for_each(words().begin(), words().end(), [&](uint64_t& w) {
+            uint32_t i = &w - words().data();
+            uint64_t removed = 0;
+            for (uint64_t bits = w; bits != 0; bits &= bits - 1) {
+                uint32_t j = std::countr_zero(bits);
+                uint64_t index = this->calChildId(i * bitLength + j);
+                if (isInside(Voxel::getCoordGL(index, halfRootEdgeLength))) {
+                    removed |= 1ull << j;
+                }
+            }
+            w &= ~removed;
+        });
+        updateWordMask();
+        report(tally, was);
+    }
+
+    // Shape is a Capsule3D or Sweep3D in GL coordinates. Only capsules can be cut in spans,
+    // sweeps always go through the batch test.
+    template <class Shape>
+    void subtract(const Shape& tool, const SubtractMode mode, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
+    {
+        switch (tool.classify(this->getBBoxGL(halfRootEdgeLength))) {
+        case Overlap::Outside:
+            return;
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return;
+        case Overlap::Partial:
+            break;
+        }
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            this->subdivide();
+        } else {
+            expand();
+        }
+        WordArray was;
+        if (tally != nullptr) {
+            was = words();
         }
-        std::for_each(std::execution::par, voxels.begin(), voxels.end(), [&](auto& v) {
-            uint32_t i = &v - voxels.data();
-            if (v == nullptr) {
+        if constexpr (std::is_same_v<Shape, Capsule3D<float>>) {
+            if (mode == SubtractMode::Span) {
+                subtractSpans(tool, halfRootEdgeLength);
+                updateWordMask();
+                report(tally, was);
                 return;
             }
-            if (v->none()) {
-                v.reset();
+        }
+        const float scale = 1.0f / (float)halfRootEdgeLength;
+        std::for_each(words().begin(), words().end(), [&](uint64_t& w) {
+            if (w == 0) {
                 return;
             }
-            for (uint32_t j = 0; j < bitLength; ++j) {
-                if (voxels[i]->test(j)) {
-                    uint64_t index = this->calChildId(i * bitLength + j);
-                    if (isInside(Voxel::getCoordGL(index, halfRootEdgeLength))) {
-                        voxels[i]->reset(j);
-                    }
-                }
+            uint32_t i = &w - words().data();
+            uint64_t index = this->calChildId(i * bitLength);
+            Vector3D<uint32_t> coord = Voxel::getCoord(index);
+            Vector3D<float> blockMin = Vector3D<float>((float)coord.x, (float)coord.y, (float)coord.z) * scale - 1.0f;
+            switch (tool.classify(AABB3D<float>(blockMin, blockMin + 4.0f * scale))) {
+            case Overlap::Outside:
+                return;
+            case Overlap::Inside:
+                w = 0;
+                return;
+            case Overlap::Partial:
+                break;
             }
+            alignas(64) float x[bitLength], y[bitLength], z[bitLength];
+            Voxel::getBlockCoordGL(index, halfRootEdgeLength, x, y, z);
+            w &= ~Tool::isInside(tool, x, y, z);
         });
+        updateWordMask();
+        report(tally, was);
     }
 
-    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const uint32_t halfRootEdgeLength)
+    // Removes several tool postures in GL coordinates, testing each word against all postures
+    // that touch it while it is in cache.
+    void subtract(std::span<const Capsule3D<float>> tools, const SubtractMode mode, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
     {
-        if (this->hasChildren) {
-            for (uint32_t i = 0; i < Node<Voxel, N>::maxChildrenCount() / bitLength; ++i) {
-                if (voxels[i] == nullptr) {
+        std::vector<Capsule3D<float>> partial;
+        switch (Capsule3D<float>::classify(tools, this->getBBoxGL(halfRootEdgeLength), partial)) {
+        case Overlap::Outside:
+            return;
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return;
+        case Overlap::Partial:
+            break;
+        }
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            this->subdivide();
+        } else {
+            expand();
+        }
+        WordArray was;
+        if (tally != nullptr) {
+            was = words();
+        }
+        if (mode == SubtractMode::Span) {
+            for (const auto& tool : partial) {
+                subtractSpans(tool, halfRootEdgeLength);
+            }
+            updateWordMask();
+            report(tally, was);
+            return;
+        }
+        const float scale = 1.0f / (float)halfRootEdgeLength;
+        std::for_each(words().begin(), words().end(), [&](uint64_t& w) {
+            if (w == 0) {
+                return;
+            }
+            uint32_t i = &w - words().data();
+            uint64_t index = this->calChildId(i * bitLength);
+            Vector3D<uint32_t> coord = Voxel::getCoord(index);
+            Vector3D<float> blockMin = Vector3D<float>((float)coord.x, (float)coord.y, (float)coord.z) * scale - 1.0f;
+            AABB3D<float> block(blockMin, blockMin + 4.0f * scale);
+            alignas(64) float x[bitLength], y[bitLength], z[bitLength];
+            bool hasCoords = false;
+            for (const auto& tool : partial) {
+                switch (tool.classify(block)) {
+                case Overlap::Outside:
                     continue;
+                case Overlap::Inside:
+                    w = 0;
+                    return;
+                case Overlap::Partial:
+                    break;
+                }
+                if (!hasCoords) {
+                    Voxel::getBlockCoordGL(index, halfRootEdgeLength, x, y, z);
+                    hasCoords = true;
+                }
+                w &= ~Tool::isInside(tool, x, y, z);
+                if (w == 0) {
+                    return;
+                }
+            }
+        });
+        updateWordMask();
+        report(tally, was);
+    }
+
+    // A brick the tool cuts into is left to reachBrick and subtract; only a covered one is removed here.
+    template <class Shape>
+    void collectBricks(const Shape& tool, const uint32_t halfRootEdgeLength, std::vector<uint64_t>& bricks, CutTally* tally = nullptr)
+    {
+        switch (tool.classify(this->getBBoxGL(halfRootEdgeLength))) {
+        case Overlap::Outside:
+            return;
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return;
+        case Overlap::Partial:
+            break;
+        }
+        bricks.push_back(this->firstVoxel());
+    }
+
+    template <class Shape>
+    Brick<N>* reachBrick(const Shape&, const uint64_t, const uint32_t, CutTally* = nullptr)
+    {
+        return this;
+    }
+
+    // Reports every active voxel of the brick to tally, when there is one, as the brick is
+    // about to be removed whole.
+    void reportRemoved(CutTally* tally) const
+    {
+        if (tally == nullptr) {
+            return;
+        }
+        if (!this->hasChildren) {
+            tally->add(this->getOrigin());
+            return;
+        }
+        WordArray scratch;
+        const uint64_t* w = view(scratch);
+        tally->add(this->getOrigin(), std::vector<uint64_t>(w, w + wordCount()));
+    }
+
+    static void reportSolid(CutTally& tally, const Vector3D<uint32_t>& origin)
+    {
+        tally.add(origin);
+    }
+
+    // Counts the voxels left active after the cuts that have a face on a voxel the cuts
+    // removed, each once, across brick faces as well. The removed voxels of each cut are
+    // shifted onto their neighbours in the same cell and in the six cells around it, and
+    // then matched against what lookup.brickAt(x, y, z, solid) finds there now.
+    template <class Lookup>
+    static uint64_t countEngaged(const std::vector<CutTally::Cut>& cuts, const Lookup& lookup)
+    {
+        constexpr int64_t e = Node<Voxel, N>::edgeLength();
+        constexpr uint32_t axisBits[3] = { wordAxisBits(0), wordAxisBits(1), wordAxisBits(2) };
+        // By the Morton code of the cell, which is never rehashed away from under a reference.
+        std::unordered_map<uint64_t, WordArray> touching;
+        auto cell = [&](const int64_t (&o)[3]) -> WordArray* {
+            if (o[0] < 0 || o[1] < 0 || o[2] < 0) {
+                return nullptr;
+            }
+            auto [it, added] = touching.try_emplace(Morton::encode((uint32_t)(o[0] / e), (uint32_t)(o[1] / e), (uint32_t)(o[2] / e)));
+            if (added) {
+                it->second.fill(0);
+            }
+            return &it->second;
+        };
+        WordArray removed;
+        for (const CutTally::Cut& cut : cuts) {
+            if (cut.words.empty()) {
+                removed.fill(~0ull);
+            } else {
+                std::copy(cut.words.begin(), cut.words.end(), removed.begin());
+            }
+            const int64_t o[3] = { cut.origin.x, cut.origin.y, cut.origin.z };
+            WordArray& own = *cell(o);
+            for (uint32_t i = 0; i < wordCount(); ++i) {
+                for (uint32_t axis = 0; axis < 3; ++axis) {
+                    const uint32_t bits = axisBits[axis];
+                    const uint32_t along = i & bits;
+                    const uint64_t below = along == 0 ? 0 : removed[((along - 1) & bits) | (i & ~bits)];
+                    const uint64_t above = along == bits ? 0 : removed[(((i | ~bits) + 1) & bits) | (i & ~bits)];
+                    own[i] |= neighbourMask(removed[i], above, axis, true) | neighbourMask(removed[i], below, axis, false);
                 }
-                if (voxels[i]->none()) {
-                    voxels[i].reset();
+            }
+            // The layer of words on each face reaches the facing layer of the next cell.
+            for (uint32_t f = 0; f < 6; ++f) {
+                const uint32_t axis = f / 2;
+                const bool positive = f % 2;
+                int64_t n[3] = { o[0], o[1], o[2] };
+                n[axis] += positive ? e : -e;
+                WordArray* next = cell(n);
+                if (next == nullptr) {
                     continue;
                 }
-                for (uint32_t j = 0; j < bitLength; ++j) {
-                    if (voxels[i]->test(j)) {
-                        uint64_t index = this->calChildId(i * bitLength + j);
-                        coords.push_back(Voxel::getCoordGL(index, halfRootEdgeLength));
-                        sizes.push_back(Voxel::edgeLengthGL(halfRootEdgeLength));
+                const uint32_t bits = axisBits[axis];
+                for (uint32_t j = 0; j < wordCount(); ++j) {
+                    if ((j & bits) == (positive ? 0 : bits)) {
+                        (*next)[j] |= neighbourMask(0, removed[(j & ~bits) | (positive ? bits : 0)], axis, !positive);
                     }
                 }
             }
+        }
+        uint64_t engaged = 0;
+        WordArray scratch;
+        for (const auto& [key, t] : touching) {
+            const Vector3D<uint32_t> origin = Morton::decode(key) * (uint32_t)e;
+            bool solid = false;
+            const Brick<N>* brick = lookup.brickAt(origin.x, origin.y, origin.z, solid);
+            const uint64_t* w = brick != nullptr ? brick->view(scratch) : nullptr;
+            if (w == nullptr && !solid) {
+                continue;
+            }
+            for (uint32_t i = 0; i < wordCount(); ++i) {
+                engaged += std::popcount(t[i] & (w != nullptr ? w[i] : ~0ull));
+            }
+        }
+        return engaged;
+    }
+
+    // A brick counts itself whenever its words change, so this only hands back what it held
+    // before the cut, for the nodes above.
+    ActiveVoxels recount(const uint64_t, const ActiveVoxels& before) const
+    {
+        return before;
+    }
+
+    void save(TopologyWriter& out, const uint32_t depth) const
+    {
+        WordArray scratch;
+        std::memcpy(out.append(depth, wordCount()), view(scratch), sizeof(WordArray));
+    }
+
+    template <class Image>
+    void load(const Image& image, const uint32_t depth, const uint64_t index)
+    {
+        this->isActive = true;
+        this->isDirty = true;
+        subdivide();
+        std::memcpy(words().data(), image.record(depth, index), sizeof(WordArray));
+        updateWordMask();
+    }
+
+    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const uint32_t halfRootEdgeLength, const bool = false)
+    {
+        if (this->hasChildren) {
+            forEachWord([&](uint32_t i, uint64_t w) {
+                for (uint64_t bits = w; bits != 0; bits &= bits - 1) {
+                    uint64_t index = this->calChildId(i * bitLength + std::countr_zero(bits));
+                    coords.push_back(Voxel::getCoordGL(index, halfRootEdgeLength));
+                    sizes.push_back(Voxel::edgeLengthGL(halfRootEdgeLength));
+                }
+            });
         } else {
             coords.push_back(Node<Voxel, N>::getCoordGL(halfRootEdgeLength));
             sizes.push_back(Node<Voxel, N>::edgeLengthGL(halfRootEdgeLength));
         }
     }
 
+    // Rewrites the segment of the brick if it is dirty.
+    template <class Surface>
+    void calculateVoxels(VoxelSegments& segments, const uint32_t halfRootEdgeLength, const Surface* surface, const bool = false)
+    {
+        if (!this->isDirty) {
+            return;
+        }
+        this->isDirty = false;
+        if (surface == nullptr) {
+            VoxelSegment& segment = segments.write(this->segmentKey());
+            calculateVoxels(segment.coords, segment.sizes, halfRootEdgeLength);
+            return;
+        }
+        std::vector<Vector3D<float>> coords;
+        std::vector<float> sizes;
+        calculateSurfaceVoxels(coords, sizes, halfRootEdgeLength, *surface);
+        if (coords.empty()) {
+            segments.remove(this->segmentKey());
+            return;
+        }
+        VoxelSegment& segment = segments.write(this->segmentKey());
+        segment.coords = std::move(coords);
+        segment.sizes = std::move(sizes);
+    }
+
+    // Emits only the voxels with at least one inactive face neighbour. Neighbours inside the
+    // brick come from shifting and masking whole words, neighbours across the brick faces
+    // from the words of the adjacent bricks found through surface.
+    template <class Surface>
+    void calculateSurfaceVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const uint32_t halfRootEdgeLength, const Surface& surface) const
+    {
+        if (!this->hasChildren) {
+            if (surface.isExposed(this->getOrigin(), this->edgeLength())) {
+                coords.push_back(Node<Voxel, N>::getCoordGL(halfRootEdgeLength));
+                sizes.push_back(Node<Voxel, N>::edgeLengthGL(halfRootEdgeLength));
+            }
+            return;
+        }
+
+        // Faces in the order -x, +x, -y, +y, -z, +z: the adjacent brick, or the fill of the
+        // tile or empty space on that side.
+        const Vector3D<uint32_t> origin = this->getOrigin();
+        const int64_t o[3] = { origin.x, origin.y, origin.z };
+        std::array<const Brick<N>*, 6> across;
+        std::array<uint64_t, 6> fill;
+        for (uint32_t f = 0; f < 6; ++f) {
+            int64_t p[3] = { o[0], o[1], o[2] };
+            p[f / 2] += (f % 2) ? (int64_t)this->edgeLength() : -1;
+            bool solid = false;
+            across[f] = surface.brickAt(p[0], p[1], p[2], solid);
+            fill[f] = solid ? ~0ull : 0;
+        }
+
+        // Compact neighbours are decoded once, up front.
+        WordArray scratch[7];
+        const uint64_t* own = view(scratch[6]);
+        std::array<const uint64_t*, 6> acrossWords = {};
+        for (uint32_t f = 0; f < 6; ++f) {
+            if (across[f] != nullptr) {
+                acrossWords[f] = across[f]->view(scratch[f]);
+            }
+        }
+
+        forEachWord(own, [&](uint32_t i, uint64_t w) {
+            const Vector3D<uint32_t> block = Morton::decode(i);
+            const uint32_t b[3] = { block.x, block.y, block.z };
+            uint64_t covered = w;
+            for (uint32_t f = 0; f < 6 && covered != 0; ++f) {
+                const uint32_t axis = f / 2;
+                const bool positive = f % 2;
+                uint32_t nb[3] = { b[0], b[1], b[2] };
+                uint64_t next;
+                if (positive ? b[axis] + 1 < blockCount : b[axis] > 0) {
+                    nb[axis] = positive ? b[axis] + 1 : b[axis] - 1;
+                    next = own[Morton::encode(nb[0], nb[1], nb[2])];
+                } else if (across[f] != nullptr) {
+                    nb[axis] = positive ? 0 : blockCount - 1;
+                    next = acrossWords[f][Morton::encode(nb[0], nb[1], nb[2])];
+                } else {
+                    next = fill[f];
+                }
+                covered &= neighbourMask(w, next, axis, positive);
+            }
+            for (uint64_t bits = w & ~covered; bits != 0; bits &= bits - 1) {
+                uint64_t index = this->calChildId(i * bitLength + std::countr_zero(bits));
+                coords.push_back(Voxel::getCoordGL(index, halfRootEdgeLength));
+                sizes.push_back(Voxel::edgeLengthGL(halfRootEdgeLength));
+            }
+        });
+    }
+
+    // Appends the brick as { this, firstVoxel, level }, or as a tile while it has no voxels of its own.
+    template <class Runs>
+    void collectLeaves(Runs& runs) const
+    {
+        runs.push_back({ this->hasChildren ? this : nullptr, this->firstVoxel(), this->hasChildren ? 0u : N });
+    }
+
+    // Calls f(x, y, z) with the voxel coordinates of every active voxel, in Morton order.
+    template <class F>
+    void forEachVoxel(F&& f) const
+    {
+        const Vector3D<uint32_t> origin = this->getOrigin();
+        const auto& local = localCoords();
+        forEachWord([&](uint32_t i, uint64_t w) {
+            for (uint64_t bits = w; bits != 0; bits &= bits - 1) {
+                const auto& v = local[i * bitLength + std::countr_zero(bits)];
+                f(origin.x + v[0], origin.y + v[1], origin.z + v[2]);
+            }
+        });
+    }
+
+    void collectDirty(std::vector<std::pair<Vector3D<uint32_t>, uint32_t>>& boxes) const
+    {
+        if (this->isDirty) {
+            boxes.emplace_back(this->getOrigin(), this->edgeLength());
+        }
+    }
+
+    void markDirty(const Vector3D<uint32_t>&, const Vector3D<uint32_t>&)
+    {
+        this->isDirty = true;
+    }
+
+    void markChanged(const Brick&)
+    {
+        this->isDirty = true;
+    }
+
+    // before is nullptr when the brick was a solid tile.
+    void writeDelta(const Brick* before, DeltaWriter& out) const
+    {
+        if (before == nullptr) {
+            out.subdivide(N, this->id);
+        }
+        WordArray scratch, beforeScratch;
+        out.words(N, this->id, before != nullptr ? before->view(beforeScratch) : nullptr, view(scratch), wordCount());
+    }
+
+    // Only Words records reach a brick.
+    bool applyDelta(const DeltaRecord& record)
+    {
+        if (record.op != DeltaOp::Words || record.level != N || record.id != this->id || !this->hasChildren || record.maskWords != wordMaskCount) {
+            return false;
+        }
+        expand();
+        uint32_t k = 0;
+        for (uint32_t m = 0; m < wordMaskCount; ++m) {
+            for (uint64_t bits = record.maskWord(m); bits != 0; bits &= bits - 1) {
+                uint32_t i = m * bitLength + std::countr_zero(bits);
+                if (i >= wordCount()) {
+                    return false;
+                }
+                words()[i] ^= record.word(k++);
+            }
+        }
+        this->isDirty = true;
+        updateWordMask();
+        return true;
+    }
+
+    bool isSolid(const Vector3D<uint32_t>& min, const Vector3D<uint32_t>& max) const
+    {
+        if (!this->hasChildren) {
+            return true;
+        }
+        const Vector3D<uint32_t> origin = this->getOrigin();
+        for (uint32_t x = min.x; x < max.x; ++x) {
+            for (uint32_t y = min.y; y < max.y; ++y) {
+                for (uint32_t z = min.z; z < max.z; ++z) {
+                    if (!voxel((uint32_t)Morton::encode(x - origin.x, y - origin.y, z - origin.z))) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Whether the voxel at local coordinates inside the brick is active; the brick must have children.
+    bool isLocalActive(const uint32_t x, const uint32_t y, const uint32_t z) const
+    {
+        return voxel((uint32_t)Morton::encode(x, y, z));
+    }
+
+    const Brick<N>* findBrick(const Vector3D<uint32_t>&, bool& solid) const
+    {
+        solid = true;
+        return this->hasChildren ? this : nullptr;
+    }
+
+    uint64_t countVoxels() const
+    {
+        return this->hasChildren ? this->counted.count : Node<Voxel, N>::maxChildrenCount();
+    }
+
+    // Picks the smallest encoding for a brick that was not changed since the last pass: a tile
+    // once every voxel is active, the voxels that differ from a fill, the run starts, or the
+    // words. A brick changed since is only marked for the next pass. A brick shared with
+    // another tree version is left alone.
+    void compact(const bool shared = false)
+    {
+        if (shared || this->refs.count.load(std::memory_order_acquire) > 1 || !this->isActive || !this->hasChildren) {
+            return;
+        }
+        if (isWarm) {
+            isWarm = false;
+            return;
+        }
+        if (encoding != BrickEncoding::Dense) {
+            return;
+        }
+        uint32_t active = 0, starts = 0;
+        uint64_t carry = 0;
+        for (uint64_t w : words()) {
+            active += std::popcount(w);
+            starts += std::popcount(w ^ ((w << 1) | carry));
+            carry = w >> (bitLength - 1);
+        }
+        if (active == Node<Voxel, N>::maxChildrenCount()) {
+            this->hasChildren = false;
+            dense.reset();
+            return;
+        }
+        const uint32_t differing = std::min(active, Node<Voxel, N>::maxChildrenCount() - active);
+        const uint32_t count = std::min(differing, starts);
+        if (count * sizeof(uint16_t) >= sizeof(WordArray)) {
+            return;
+        }
+        codes = std::make_unique<uint16_t[]>(count);
+        codeCount = (uint16_t)count;
+        uint32_t k = 0;
+        if (differing <= starts) {
+            encoding = BrickEncoding::Sparse;
+            sparseFill = differing != active;
+            const uint64_t flip = sparseFill ? ~0ull : 0;
+            for (uint32_t i = 0; i < wordCount(); ++i) {
+                for (uint64_t bits = words()[i] ^ flip; bits != 0; bits &= bits - 1) {
+                    codes[k++] = (uint16_t)(i * bitLength + std::countr_zero(bits));
+                }
+            }
+        } else {
+            encoding = BrickEncoding::Runs;
+            carry = 0;
+            for (uint32_t i = 0; i < wordCount(); ++i) {
+                const uint64_t w = words()[i];
+                for (uint64_t bits = w ^ ((w << 1) | carry); bits != 0; bits &= bits - 1) {
+                    codes[k++] = (uint16_t)(i * bitLength + std::countr_zero(bits));
+                }
+                carry = w >> (bitLength - 1);
+            }
+        }
+        dense.reset();
+    }
+
+    // A dirty brick whose voxels are all active again becomes a tile.
+    void prune()
+    {
+        if (canPrune()) {
+            this->hasChildren = false;
+            dense.reset();
+            codes.reset();
+            codeCount = 0;
+            encoding = BrickEncoding::Dense;
+        }
+    }
+
+    bool canPrune() const
+    {
+        return this->isDirty && this->isActive && this->hasChildren && countVoxels() == Node<Voxel, N>::maxChildrenCount();
+    }
+
+    void collectStorage(BrickStorageStats& stats) const
+    {
+        stats.bytes += sizeof(Brick) + (dense != nullptr ? sizeof(WordArray) : 0) + codeCount * sizeof(uint16_t);
+        if (!this->isActive) {
+            ++stats.inactive;
+        } else if (!this->hasChildren) {
+            ++stats.tiles;
+        } else if (encoding == BrickEncoding::Sparse) {
+            ++stats.sparse;
+        } else if (encoding == BrickEncoding::Runs) {
+            ++stats.runs;
+        } else {
+            ++stats.dense;
+        }
+    }
+
 private:
-    static const size_t bitLength = 64;
-    std::array<std::unique_ptr<std::bitset<bitLength>>, Node<Voxel, N>::maxChildrenCount() / bitLength> voxels;
+    static constexpr uint32_t bitLength = 64;
+    static constexpr uint32_t wordMaskCount = (wordCount() + bitLength - 1) / bitLength;
+    static constexpr uint32_t blockCount = (1 << N) / 4; // 4x4x4 blocks per brick edge, one per word
+
+    struct alignas(64) WordArray : std::array<uint64_t, wordCount()> { };
+
+    // Coordinates inside the brick of every voxel index, so that walking the voxels needs no Morton decode.
+    static const std::array<std::array<uint8_t, 3>, Node<Voxel, N>::maxChildrenCount()>& localCoords()
+    {
+        static const auto table = [] {
+            std::array<std::array<uint8_t, 3>, Node<Voxel, N>::maxChildrenCount()> t;
+            for (uint32_t i = 0; i < t.size(); ++i) {
+                Vector3D<uint32_t> v = Morton::decode(i);
+                t[i] = { (uint8_t)v.x, (uint8_t)v.y, (uint8_t)v.z };
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    // Bits of a word index that hold the coordinate of its block along axis.
+    static constexpr uint32_t wordAxisBits(uint32_t axis)
+    {
+        uint32_t mask = 0;
+        for (uint32_t b = 2 - axis; (1u << b) < wordCount(); b += 3) {
+            mask |= 1u << b;
+        }
+        return mask;
+    }
+
+    // Bits of a word whose voxel offset inside the 4x4x4 block has the given bit set.
+    static constexpr uint64_t bitsWith(uint32_t bit)
+    {
+        uint64_t mask = 0;
+        for (uint32_t j = 0; j < bitLength; ++j) {
+            if (j & bit) {
+                mask |= 1ull << j;
+            }
+        }
+        return mask;
+    }
+
+    // Bits of a word whose voxel lies at offset o, 0 to 3, along axis inside the 4x4x4 block.
+    static constexpr uint64_t bitsAt(uint32_t axis, uint32_t o)
+    {
+        constexpr auto table = [] {
+            std::array<std::array<uint64_t, 4>, 3> t = {};
+            for (uint32_t a = 0; a < 3; ++a) {
+                const uint64_t lo = bitsWith(1u << (2 - a));
+                const uint64_t hi = bitsWith(1u << (5 - a));
+                for (uint32_t k = 0; k < 4; ++k) {
+                    t[a][k] = ((k & 1) ? lo : ~lo) & ((k & 2) ? hi : ~hi);
+                }
+            }
+            return t;
+        }();
+        return table[axis][o];
+    }
+
+    // Bit j is set when the face neighbour of voxel j along axis, on the positive or negative
+    // side, is active. w is the word itself and next the word of the adjacent block on that side.
+    // The 2-bit offset along the axis is spread over bits lo and hi of the voxel index.
+    static constexpr uint64_t neighbourMask(uint64_t w, uint64_t next, uint32_t axis, bool positive)
+    {
+        constexpr uint64_t lowBits[3] = { bitsWith(4), bitsWith(2), bitsWith(1) };
+        constexpr uint64_t highBits[3] = { bitsWith(32), bitsWith(16), bitsWith(8) };
+        const uint32_t lo = 1u << (2 - axis);
+        const uint32_t hi = 1u << (5 - axis);
+        const uint64_t low = lowBits[axis];
+        const uint64_t high = highBits[axis];
+        if (positive) {
+            return ((w >> lo) & ~low) // 0 -> 1, 2 -> 3
+                | ((w >> (hi - lo)) & low & ~high) // 1 -> 2
+                | ((next << (hi + lo)) & low & high); // 3 -> 0 of the next block
+        }
+        return ((w << lo) & low) // 1 -> 0, 3 -> 2
+            | ((w << (hi - lo)) & ~low & high) // 2 -> 1
+            | ((next >> (hi + lo)) & ~low & ~high); // 0 -> 3 of the previous block
+    }
+
+    // Tells tally, when there is one, which voxels a cut removed that left the words as they
+    // are now, from was.
+    void report(CutTally* tally, const WordArray& was) const
+    {
+        if (tally == nullptr) {
+            return;
+        }
+        std::vector<uint64_t> removed(wordCount());
+        uint64_t any = 0;
+        for (uint32_t i = 0; i < wordCount(); ++i) {
+            removed[i] = was[i] & ~words()[i];
+            any |= removed[i];
+        }
+        if (any != 0) {
+            tally->add(this->getOrigin(), std::move(removed));
+        }
+    }
+
+    // Clears the voxels of every x row that fall inside the tool. The entry and exit
+    // of each row are solved in closed form. Only an end that lands within rounding
+    // distance of a voxel center is settled by point-testing the voxels next to it.
+    void subtractSpans(const Capsule3D<float>& tool, const uint32_t halfRootEdgeLength)
+    {
+        constexpr float ambiguity = 1.0f / 64.0f;
+        const float scale = 1.0f / (float)halfRootEdgeLength;
+        const Vector3D<uint32_t> origin = Voxel::getCoord(this->calChildId(0));
+        const Vector3D<float> originGL = Vector3D<float>((float)origin.x, (float)origin.y, (float)origin.z) * scale - 1.0f;
+        const int32_t last = (1 << N) - 1;
+        auto centerGL = [&](int32_t x, uint32_t y, uint32_t z) {
+            return Vector3D<float>(
+                ((float)(origin.x + x) + 0.5f) * scale - 1.0f,
+                ((float)(origin.y + y) + 0.5f) * scale - 1.0f,
+                ((float)(origin.z + z) + 0.5f) * scale - 1.0f);
+        };
+        auto isAmbiguous = [&](float t) {
+            return std::abs(t - std::round(t)) < ambiguity;
+        };
+
+        // Rows of 4x4x4 blocks, so a row that misses or covers the tool settles a whole run of words.
+        for (uint32_t r = 0; r < blockCount * blockCount; ++r) {
+            uint32_t by = r / blockCount, bz = r % blockCount;
+            Vector3D<float> rowMin = originGL + Vector3D<float>(0.0f, (float)(by * 4), (float)(bz * 4)) * scale;
+            Vector3D<float> rowMax = rowMin + Vector3D<float>((float)(1 << N), 4.0f, 4.0f) * scale;
+            switch (tool.classify(AABB3D<float>(rowMin, rowMax))) {
+            case Overlap::Outside:
+                continue;
+            case Overlap::Inside:
+                for (uint32_t bx = 0; bx < blockCount; ++bx) {
+                    words()[Morton::encode(bx, by, bz)] = 0;
+                }
+                continue;
+            case Overlap::Partial:
+                break;
+            }
+            for (uint32_t y = by * 4; y < by * 4 + 4; ++y) {
+                for (uint32_t z = bz * 4; z < bz * 4 + 4; ++z) {
+                    float t0, t1;
+                    if (!tool.intersectLine(centerGL(0, y, z), Vector3D<float>(scale, 0, 0), t0, t1)) {
+                        continue;
+                    }
+                    t0 = std::max(t0, -1.0f);
+                    t1 = std::min(t1, (float)last + 1.0f);
+                    int32_t lo = std::max((int32_t)std::ceil(t0), 0);
+                    int32_t hi = std::min((int32_t)std::floor(t1), last);
+                    if (isAmbiguous(t0)) {
+                        while (lo > 0 && tool.isInside(centerGL(lo - 1, y, z))) {
+                            --lo;
+                        }
+                        while (lo <= hi && !tool.isInside(centerGL(lo, y, z))) {
+                            ++lo;
+                        }
+                    }
+                    if (isAmbiguous(t1)) {
+                        while (hi < last && tool.isInside(centerGL(hi + 1, y, z))) {
+                            ++hi;
+                        }
+                        while (hi >= lo && !tool.isInside(centerGL(hi, y, z))) {
+                            --hi;
+                        }
+                    }
+                    if (lo <= hi) {
+                        clearRow((uint32_t)lo, (uint32_t)hi, y, z);
+                    }
+                }
+            }
+        }
+    }
+
+    // Clears voxels x0..x1 of the x row at (y, z).
+    void clearRow(uint32_t x0, uint32_t x1, uint32_t y, uint32_t z)
+    {
+        // The bits of x offsets lo..hi in the row of a word at y = z = 0, and the word index of
+        // block (bx, 0, 0), both in Morton order.
+        static constexpr auto rowBits = [] {
+            std::array<std::array<uint64_t, 4>, 4> t = {};
+            constexpr uint32_t xBit[4] = { 0, 4, 32, 36 };
+            for (uint32_t lo = 0; lo < 4; ++lo) {
+                for (uint32_t hi = lo; hi < 4; ++hi) {
+                    for (uint32_t x = lo; x <= hi; ++x) {
+                        t[lo][hi] |= 1ull << xBit[x];
+                    }
+                }
+            }
+            return t;
+        }();
+        const uint32_t yzBit = (uint32_t)Morton::encode(0, y & 3, z & 3);
+        const uint64_t yzWord = Morton::encode(0, y / 4, z / 4);
+        for (uint32_t bx = x0 / 4; bx <= x1 / 4; ++bx) {
+            const uint32_t lo = std::max(x0, bx * 4) & 3;
+            const uint32_t hi = std::min(x1, bx * 4 + 3) & 3;
+            words()[Morton::encode(bx, 0, 0) | yzWord] &= ~(rowBits[lo][hi] << yzBit);
+        }
+    }
+
+    // Visits the non-empty words in index order, skipping empty ones through the summary mask.
+    template <class F>
+    void forEachWord(F&& f) const
+    {
+        WordArray scratch;
+        forEachWord(view(scratch), f);
+    }
+
+    template <class F>
+    void forEachWord(const uint64_t* w, F&& f) const
+    {
+        for (uint32_t m = 0; m < wordMaskCount; ++m) {
+            for (uint64_t bits = wordMask[m]; bits != 0; bits &= bits - 1) {
+                uint32_t i = m * bitLength + std::countr_zero(bits);
+                f(i, w[i]);
+            }
+        }
+    }
+
+    // The words of a dense brick, which subdivide or expand provide before they are changed.
+    WordArray& words()
+    {
+        return *dense;
+    }
+
+    const WordArray& words() const
+    {
+        return *dense;
+    }
+
+    // The words of a subdivided brick in any encoding, decoded into scratch unless it is dense.
+    const uint64_t* view(WordArray& scratch) const
+    {
+        if (encoding == BrickEncoding::Dense) {
+            return dense->data();
+        }
+        decode(scratch);
+        return scratch.data();
+    }
+
+    void decode(WordArray& out) const
+    {
+        if (encoding == BrickEncoding::Sparse) {
+            out.fill(sparseFill ? ~0ull : 0);
+            for (uint32_t k = 0; k < codeCount; ++k) {
+                out[codes[k] / bitLength] ^= 1ull << (codes[k] % bitLength);
+            }
+            return;
+        }
+        out.fill(0);
+        for (uint32_t k = 0; k < codeCount; k += 2) {
+            const uint32_t first = codes[k];
+            const uint32_t last = k + 1 < codeCount ? codes[k + 1] : Node<Voxel, N>::maxChildrenCount();
+            for (uint32_t i = first / bitLength; i * bitLength < last; ++i) {
+                const uint32_t lo = std::max(first, i * bitLength) - i * bitLength;
+                const uint32_t hi = std::min(last, (i + 1) * bitLength) - i * bitLength;
+                out[i] |= (hi - lo == bitLength ? ~0ull : ((1ull << (hi - lo)) - 1)) << lo;
+            }
+        }
+    }
+
+    // Brings a compact brick back to words before they are changed, and marks it as changed.
+    void expand()
+    {
+        isWarm = true;
+        if (encoding == BrickEncoding::Dense) {
+            return;
+        }
+        dense = std::make_unique<WordArray>();
+        decode(*dense);
+        codes.reset();
+        codeCount = 0;
+        encoding = BrickEncoding::Dense;
+    }
+
+    // Whether voxel j of a subdivided brick is active.
+    bool voxel(const uint32_t j) const
+    {
+        switch (encoding) {
+        case BrickEncoding::Sparse:
+            return sparseFill != std::binary_search(codes.get(), codes.get() + codeCount, (uint16_t)j);
+        case BrickEncoding::Runs:
+            return (std::upper_bound(codes.get(), codes.get() + codeCount, (uint16_t)j) - codes.get()) & 1;
+        case BrickEncoding::Dense:
+            break;
+        }
+        return (words()[j / bitLength] >> (j % bitLength)) & 1;
+    }
+
+    // Rebuilds the summary mask and the count after the words were changed, and deactivates the
+    // brick once it is empty.
+    void updateWordMask()
+    {
+        uint64_t count = 0;
+        for (uint32_t m = 0; m < wordMaskCount; ++m) {
+            uint64_t mask = 0;
+            for (uint32_t b = 0; b < bitLength && m * bitLength + b < wordCount(); ++b) {
+                const uint64_t w = words()[m * bitLength + b];
+                mask |= (uint64_t)(w != 0) << b;
+                count += std::popcount(w);
+            }
+            wordMask[m] = mask;
+        }
+        if (count == 0) {
+            this->isActive = false;
+            this->counted = {};
+            return;
+        }
+        uint32_t min[3], max[3];
+        for (uint32_t axis = 0; axis < 3; ++axis) {
+            min[axis] = bound(axis, false);
+            max[axis] = bound(axis, true) + 1;
+        }
+        const Vector3D<uint32_t> origin = this->getOrigin();
+        this->counted = { count, origin + Vector3D<uint32_t>(min[0], min[1], min[2]), origin + Vector3D<uint32_t>(max[0], max[1], max[2]) };
+    }
+
+    // The lowest or highest voxel coordinate along axis inside the brick that holds an active
+    // voxel. Each summary mask word is itself a 4x4x4 block of words in Morton order, so it gives
+    // the outermost plane of blocks, and only the words on that plane are read.
+    uint32_t bound(const uint32_t axis, const bool highest) const
+    {
+        uint32_t plane = highest ? 0 : ~0u;
+        for (uint32_t m = 0; m < wordMaskCount; ++m) {
+            if (wordMask[m] != 0) {
+                const uint32_t b = groupOrigin(m, axis) + offsetAlong(wordMask[m], axis, highest);
+                plane = highest ? std::max(plane, b) : std::min(plane, b);
+            }
+        }
+        uint64_t bits = 0;
+        for (uint32_t m = 0; m < wordMaskCount; ++m) {
+            const uint32_t g = groupOrigin(m, axis);
+            if (plane < g || plane >= g + 4) {
+                continue;
+            }
+            for (uint64_t on = wordMask[m] & bitsAt(axis, plane - g); on != 0; on &= on - 1) {
+                bits |= words()[m * bitLength + std::countr_zero(on)];
+            }
+        }
+        return plane * 4 + offsetAlong(bits, axis, highest);
+    }
+
+    // The first block along axis of the 4x4x4 blocks of words that summary mask word m covers.
+    static uint32_t groupOrigin(const uint32_t m, const uint32_t axis)
+    {
+        const Vector3D<uint32_t> g = Morton::decode(m);
+        return (axis == 0 ? g.x : axis == 1 ? g.y : g.z) * 4;
+    }
+
+    // The lowest or highest offset along axis inside the 4x4x4 block of a non-zero word that has a bit set.
+    static uint32_t offsetAlong(const uint64_t w, const uint32_t axis, const bool highest)
+    {
+        uint32_t o = highest ? 3 : 0;
+        while ((w & bitsAt(axis, o)) == 0) {
+            o = highest ? o - 1 : o + 1;
+        }
+        return o;
+    }
+
+    std::unique_ptr<WordArray> dense; // while the encoding is Dense and the brick has children
+    std::unique_ptr<uint16_t[]> codes; // the voxel indices of Sparse or the run starts of Runs
+    BrickEncoding encoding = BrickEncoding::Dense;
+    bool sparseFill = false; // whether the voxels Sparse does not list are active
+    bool isWarm = true; // changed since the last compaction
+    uint16_t codeCount = 0;
+    std::array<uint64_t, wordMaskCount> wordMask;
 };
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "AABB3D.h"
+#include "Vector3D.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <span>
+#include <utility>
+#include <vector>
+
+// How a box relates to a tool shape.
+enum class Overlap {
+    Outside,
+    Inside,
+    Partial,
+};
+
+// A ball-end cylinder: a cylinder of the given radius running from base to
+// base + axis * length, closed by a hemisphere around base and flat at the far end.
+template <class T>
+class Capsule3D {
+public:
+    Capsule3D() = default;
+    ~Capsule3D() = default;
+
+    constexpr inline Capsule3D(const Vector3D<T>& base, const Vector3D<T>& axis, const T radius, const T length) noexcept
+        : base(base)
+        , axis(axis.normalize())
+        , radius(radius)
+        , length(length)
+    {
+    }
+
+    constexpr inline Vector3D<T> getBase() const noexcept
+    {
+        return base;
+    }
+
+    constexpr inline Vector3D<T> getAxis() const noexcept
+    {
+        return axis;
+    }
+
+    constexpr inline T getRadius() const noexcept
+    {
+        return radius;
+    }
+
+    constexpr inline T getLength() const noexcept
+    {
+        return length;
+    }
+
+    constexpr inline bool isInside(const Vector3D<T>& p) const noexcept
+    {
+        Vector3D<T> d = p - base;
+        T t = d.dot(axis);
+        if (t > length) {
+            return false;
+        }
+        Vector3D<T> q = d - axis * std::max(t, (T)0);
+        return q.dot(q) <= radius * radius;
+    }
+
+    // Classifies the box as untouched, fully covered or partially covered. Outside uses the
+    // exact distance between the box and the axis segment, Inside tests the eight corners,
+    // which is exact because the shape is convex.
+    inline Overlap classify(const AABB3D<T>& box) const noexcept
+    {
+        Vector3D<T> min = box.getMin();
+        Vector3D<T> max = box.getMax();
+        T extent = box.getHalfSize(0) * std::abs(axis.x) + box.getHalfSize(1) * std::abs(axis.y) + box.getHalfSize(2) * std::abs(axis.z);
+        if ((box.getCenter() - base).dot(axis) - extent > length) {
+            return Overlap::Outside;
+        }
+        if (segmentDistanceSquared(min, max) > radius * radius) {
+            return Overlap::Outside;
+        }
+        for (uint32_t i = 0; i < 8; ++i) {
+            Vector3D<T> corner((i & 4) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 1) ? max.z : min.z);
+            if (!isInside(corner)) {
+                return Overlap::Partial;
+            }
+        }
+        return Overlap::Inside;
+    }
+
+    // Classifies the box against a set of capsules: Inside when any of them covers it, otherwise
+    // Partial with the capsules that touch it collected in `partial`, or Outside.
+    static inline Overlap classify(std::span<const Capsule3D<T>> capsules, const AABB3D<T>& box, std::vector<Capsule3D<T>>& partial)
+    {
+        partial.clear();
+        for (const auto& c : capsules) {
+            switch (c.classify(box)) {
+            case Overlap::Inside:
+                partial.clear();
+                return Overlap::Inside;
+            case Overlap::Partial:
+                partial.push_back(c);
+                break;
+            case Overlap::Outside:
+                break;
+            }
+        }
+        return partial.empty() ? Overlap::Outside : Overlap::Partial;
+    }
+
+    // Finds the parameter range [t0, t1] over which origin + t * dir lies inside the capsule.
+    // Returns false when the line misses it.
+    constexpr inline bool intersectLine(const Vector3D<T>& origin, const Vector3D<T>& dir, T& t0, T& t1) const noexcept
+    {
+        Vector3D<T> w = origin - base;
+        T wa = w.dot(axis);
+        T da = dir.dot(axis);
+
+        // Cylinder part: inside the infinite cylinder and between the two end planes.
+        T c0 = 0, c1 = 0;
+        bool hasCylinder = intersectQuadratic(w - axis * wa, dir - axis * da, c0, c1)
+            && clipSlab(wa, da, (T)0, length, c0, c1);
+
+        // Hemisphere part: inside the sphere around base and below the flat end.
+        T s0 = 0, s1 = 0;
+        bool hasSphere = intersectQuadratic(w, dir, s0, s1)
+            && clipSlab(wa, da, std::numeric_limits<T>::lowest(), length, s0, s1);
+
+        if (hasCylinder && hasSphere) {
+            t0 = std::min(c0, s0);
+            t1 = std::max(c1, s1);
+        } else if (hasCylinder) {
+            t0 = c0;
+            t1 = c1;
+        } else if (hasSphere) {
+            t0 = s0;
+            t1 = s1;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Maps the capsule through p' = p * scale + offset.
+    constexpr inline Capsule3D<T> transformed(const T scale, const Vector3D<T>& offset) const noexcept
+    {
+        return Capsule3D<T>(base * scale + offset, axis, radius * scale, length * scale);
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const Capsule3D<T>& c) noexcept
+    {
+        os << "Capsule3D: base: " << c.base << " axis: " << c.axis << " radius: " << c.radius << " length: " << c.length;
+        return os;
+    }
+
+private:
+    // Squared distance between the axis segment and the box [min, max]. The distance from
+    // base + axis * t to the box is a quadratic in t between the points where the segment
+    // crosses a face plane, so the minimum of each piece is found in closed form.
+    inline T segmentDistanceSquared(const Vector3D<T>& min, const Vector3D<T>& max) const noexcept
+    {
+        const T p0[3] = { base.x, base.y, base.z };
+        const T a[3] = { axis.x, axis.y, axis.z };
+        const T lo[3] = { min.x, min.y, min.z };
+        const T hi[3] = { max.x, max.y, max.z };
+
+        // The two ends and at most two face crossings per axis, kept sorted as they come.
+        std::array<T, 8> ts;
+        uint32_t n = 0;
+        ts[n++] = 0;
+        ts[n++] = length;
+        for (uint32_t i = 0; i < 3; ++i) {
+            if (a[i] == 0) {
+                continue;
+            }
+            for (T bound : { lo[i], hi[i] }) {
+                T t = (bound - p0[i]) / a[i];
+                if (t > 0 && t < length) {
+                    uint32_t k = n++;
+                    for (; k > 0 && ts[k - 1] > t; --k) {
+                        ts[k] = ts[k - 1];
+                    }
+                    ts[k] = t;
+                }
+            }
+        }
+
+        T best = std::numeric_limits<T>::max();
+        for (uint32_t k = 0; k + 1 < n; ++k) {
+            T mid = (ts[k] + ts[k + 1]) / 2;
+            T qa = 0, qb = 0, qc = 0;
+            for (uint32_t i = 0; i < 3; ++i) {
+                T p = p0[i] + a[i] * mid;
+                T bound;
+                if (p < lo[i]) {
+                    bound = lo[i];
+                } else if (p > hi[i]) {
+                    bound = hi[i];
+                } else {
+                    continue;
+                }
+                T e = p0[i] - bound;
+                qa += a[i] * a[i];
+                qb += a[i] * e;
+                qc += e * e;
+            }
+            T t = qa > 0 ? std::clamp(-qb / qa, ts[k], ts[k + 1]) : ts[k];
+            best = std::min(best, (qa * t + 2 * qb) * t + qc);
+        }
+        return std::max(best, (T)0);
+    }
+
+    // Solves |w + t * d| <= radius for t.
+    constexpr inline bool intersectQuadratic(const Vector3D<T>& w, const Vector3D<T>& d, T& t0, T& t1) const noexcept
+    {
+        T a = d.dot(d);
+        T b = w.dot(d);
+        T c = w.dot(w) - radius * radius;
+        if (a <= 0) {
+            t0 = std::numeric_limits<T>::lowest();
+            t1 = std::numeric_limits<T>::max();
+            return c <= 0;
+        }
+        T disc = b * b - a * c;
+        if (disc < 0) {
+            return false;
+        }
+        T root = std::sqrt(disc);
+        t0 = (-b - root) / a;
+        t1 = (-b + root) / a;
+        return true;
+    }
+
+    // Narrows [t0, t1] to where lo <= wa + t * da <= hi.
+    static constexpr inline bool clipSlab(const T wa, const T da, const T lo, const T hi, T& t0, T& t1) noexcept
+    {
+        if (da == 0) {
+            return wa >= lo && wa <= hi;
+        }
+        T a = (lo - wa) / da;
+        T b = (hi - wa) / da;
+        if (a > b) {
+            std::swap(a, b);
+        }
+        t0 = std::max(t0, a);
+        t1 = std::min(t1, b);
+        return t0 <= t1;
+    }
+
+    Vector3D<T> base;
+    Vector3D<T> axis = Vector3D<T>(0, 0, 1);
+    T radius = 0;
+    T length = 0;
+};
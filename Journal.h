@@ -0,0 +1,563 @@
+#pragma once
+
+#include "TopologyFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A journal is a header followed by blocks appended as the stock is cut. A step block holds
+// the changes of one step as delta records; a checkpoint block names a file saved by
+// Topology::save with the tree after that step. The first block is always checkpoint 0, the
+// tree when recording started. A block cut short by a crash ends the journal. Like saved
+// trees, journals are written in the byte order of the machine and rejected on another one.
+struct JournalFileHeader {
+    static constexpr char magicValue[4] = { 'V', 'D', 'B', 'J' };
+    static constexpr uint32_t currentVersion = 1;
+    static constexpr uint32_t byteOrderValue = 0x01020304;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint8_t n[TopologyFileHeader::maxLevels]; // log2 of the children per edge, root first
+    float length;
+    float width;
+    float height;
+};
+
+enum class JournalBlock : uint32_t {
+    Step,
+    Checkpoint,
+};
+
+struct JournalBlockHeader {
+    uint64_t step;
+    JournalBlock kind;
+    uint32_t size; // bytes of payload after the header
+};
+
+// One change to a node, named by its level (the sumN of the node) and its Morton id at that
+// level. Deactivate, Tile and Subdivide replace the node: it becomes empty, a solid tile, or a
+// node whose children are all solid tiles, a full brick for a brick. Words flips the bits of a
+// brick: bit k of the mask selects word k, and the XOR of the selected words follows in order.
+enum class DeltaOp : uint8_t {
+    Deactivate,
+    Tile,
+    Subdivide,
+    Words,
+};
+
+struct DeltaRecord {
+    DeltaOp op;
+    uint32_t level;
+    uint64_t id;
+    uint32_t maskWords = 0;
+    const std::byte* mask = nullptr;
+    const std::byte* words = nullptr;
+
+    uint64_t firstVoxel() const
+    {
+        return id << (level * 3);
+    }
+
+    uint64_t maskWord(const uint32_t m) const
+    {
+        return load(mask + m * sizeof(uint64_t));
+    }
+
+    // The k-th word of the payload, the XOR of the k-th selected brick word.
+    uint64_t word(const uint32_t k) const
+    {
+        return load(words + k * sizeof(uint64_t));
+    }
+
+private:
+    static uint64_t load(const std::byte* p)
+    {
+        uint64_t w;
+        std::memcpy(&w, p, sizeof(w));
+        return w;
+    }
+};
+
+// Encodes the delta records of one step. A record is the op and level bytes and the id as
+// a variable length integer; Words adds the mask length, the mask and the changed words.
+class DeltaWriter {
+public:
+    void deactivate(const uint32_t level, const uint64_t id)
+    {
+        begin(DeltaOp::Deactivate, level, id);
+    }
+
+    void tile(const uint32_t level, const uint64_t id)
+    {
+        begin(DeltaOp::Tile, level, id);
+    }
+
+    void subdivide(const uint32_t level, const uint64_t id)
+    {
+        begin(DeltaOp::Subdivide, level, id);
+    }
+
+    // Records the words of a brick that differ between before and after; before is nullptr
+    // for a brick that was full. Nothing is written when no word changed.
+    void words(const uint32_t level, const uint64_t id, const uint64_t* before, const uint64_t* after, const uint32_t count)
+    {
+        const uint32_t maskWords = (count + 63) / 64;
+        mask.assign(maskWords, 0);
+        changed.clear();
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t x = (before != nullptr ? before[i] : ~0ull) ^ after[i];
+            if (x != 0) {
+                mask[i / 64] |= 1ull << (i % 64);
+                changed.push_back(x);
+            }
+        }
+        if (changed.empty()) {
+            return;
+        }
+        begin(DeltaOp::Words, level, id);
+        bytes.push_back((std::byte)maskWords);
+        append(mask.data(), mask.size());
+        append(changed.data(), changed.size());
+    }
+
+    bool empty() const
+    {
+        return bytes.empty();
+    }
+
+    uint64_t recordCount() const
+    {
+        return records;
+    }
+
+    void clear()
+    {
+        bytes.clear();
+        records = 0;
+    }
+
+    // Hands over the encoded records and starts a new step.
+    std::vector<std::byte> take()
+    {
+        records = 0;
+        return std::exchange(bytes, {});
+    }
+
+private:
+    void begin(const DeltaOp op, const uint32_t level, uint64_t id)
+    {
+        ++records;
+        bytes.push_back((std::byte)op);
+        bytes.push_back((std::byte)level);
+        do {
+            bytes.push_back((std::byte)((id & 0x7f) | (id > 0x7f ? 0x80 : 0)));
+            id >>= 7;
+        } while (id != 0);
+    }
+
+    void append(const uint64_t* words, const size_t count)
+    {
+        size_t at = bytes.size();
+        bytes.resize(at + count * sizeof(uint64_t));
+        std::memcpy(bytes.data() + at, words, count * sizeof(uint64_t));
+    }
+
+    std::vector<std::byte> bytes;
+    uint64_t records = 0;
+    std::vector<uint64_t> mask; // scratch of words()
+    std::vector<uint64_t> changed;
+};
+
+// Walks the records of one step. next() returns false at the end, and also at a record that
+// runs past the end or has an unknown op, in which case failed() is true.
+class DeltaReader {
+public:
+    explicit DeltaReader(const std::span<const std::byte> bytes)
+        : bytes(bytes)
+    {
+    }
+
+    bool next(DeltaRecord& record)
+    {
+        if (at == bytes.size()) {
+            return false;
+        }
+        if (bytes.size() - at < 3 || (uint8_t)bytes[at] > (uint8_t)DeltaOp::Words) {
+            return fail();
+        }
+        record.op = (DeltaOp)bytes[at++];
+        record.level = (uint32_t)bytes[at++];
+        record.id = 0;
+        for (uint32_t shift = 0;; shift += 7) {
+            if (at == bytes.size() || shift > 63) {
+                return fail();
+            }
+            uint8_t b = (uint8_t)bytes[at++];
+            record.id |= (uint64_t)(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                break;
+            }
+        }
+        record.maskWords = 0;
+        record.mask = nullptr;
+        record.words = nullptr;
+        if (record.op != DeltaOp::Words) {
+            return true;
+        }
+        if (at == bytes.size()) {
+            return fail();
+        }
+        record.maskWords = (uint32_t)bytes[at++];
+        if (bytes.size() - at < record.maskWords * sizeof(uint64_t)) {
+            return fail();
+        }
+        record.mask = bytes.data() + at;
+        at += record.maskWords * sizeof(uint64_t);
+        uint64_t changed = 0;
+        for (uint32_t m = 0; m < record.maskWords; ++m) {
+            changed += std::popcount(record.maskWord(m));
+        }
+        if ((bytes.size() - at) / sizeof(uint64_t) < changed) {
+            return fail();
+        }
+        record.words = bytes.data() + at;
+        at += changed * sizeof(uint64_t);
+        return true;
+    }
+
+    bool failed() const
+    {
+        return error;
+    }
+
+private:
+    bool fail()
+    {
+        error = true;
+        at = bytes.size();
+        return false;
+    }
+
+    std::span<const std::byte> bytes;
+    size_t at = 0;
+    bool error = false;
+};
+
+// Appends blocks to a journal file on a thread of its own, so that recording a step only
+// costs encoding it. Blocks and checkpoints are written in the order they were queued.
+class JournalWriter {
+public:
+    JournalWriter() = default;
+
+    ~JournalWriter()
+    {
+        close();
+    }
+
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+
+    // Creates the file, replacing any previous journal there. Returns false when it cannot be written.
+    bool open(const std::string& path, JournalFileHeader header)
+    {
+        close();
+        std::memcpy(header.magic, JournalFileHeader::magicValue, sizeof(header.magic));
+        header.version = JournalFileHeader::currentVersion;
+        header.byteOrder = JournalFileHeader::byteOrderValue;
+        out.open(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        filePath = path;
+        error = !out;
+        bytes = sizeof(header);
+        stopping = false;
+        writer = std::thread(&JournalWriter::run, this);
+        return true;
+    }
+
+    // Writes out what is queued and closes the file.
+    void close()
+    {
+        if (!writer.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+        out.close();
+    }
+
+    bool isOpen() const
+    {
+        return writer.joinable();
+    }
+
+    void append(const uint64_t step, std::vector<std::byte> payload)
+    {
+        post([this, step, payload = std::move(payload)] {
+            write(JournalBlock::Step, step, payload.data(), payload.size());
+        });
+    }
+
+    // Calls save with the path of the checkpoint file of step on the writer thread, and
+    // records the checkpoint once save returned true.
+    void checkpoint(const uint64_t step, std::function<bool(const std::string&)> save)
+    {
+        post([this, step, save = std::move(save)] {
+            std::string name = std::filesystem::path(filePath).filename().string() + "." + std::to_string(step) + ".vdbt";
+            if (!save((std::filesystem::path(filePath).parent_path() / name).string())) {
+                error = true;
+                return;
+            }
+            write(JournalBlock::Checkpoint, step, reinterpret_cast<const std::byte*>(name.data()), name.size());
+        });
+    }
+
+    // Waits until everything queued so far is written.
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return jobs.empty() && !busy; });
+        out.flush();
+    }
+
+    // True once a block or a checkpoint could not be written.
+    bool failed() const
+    {
+        return error.load(std::memory_order_relaxed);
+    }
+
+    uint64_t bytesWritten() const
+    {
+        return bytes.load(std::memory_order_relaxed);
+    }
+
+    const std::string& path() const
+    {
+        return filePath;
+    }
+
+private:
+    void post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                return;
+            }
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+            job();
+            job = nullptr; // snapshots held by a checkpoint are released on this thread
+            lock.lock();
+            busy = false;
+            if (jobs.empty()) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    void write(const JournalBlock kind, const uint64_t step, const std::byte* payload, const size_t size)
+    {
+        JournalBlockHeader header = { step, kind, (uint32_t)size };
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(payload), (std::streamsize)size);
+        if (!out) {
+            error = true;
+        }
+        bytes.fetch_add(sizeof(header) + size, std::memory_order_relaxed);
+    }
+
+    std::ofstream out; // used by the writer thread only while it runs
+    std::string filePath;
+    std::atomic<bool> error = false;
+    std::atomic<uint64_t> bytes = 0;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<std::function<void()>> jobs;
+    bool busy = false;
+    bool stopping = false;
+    std::thread writer;
+};
+
+// A journal mapped read-only, with its blocks indexed by step.
+class JournalReader {
+public:
+    // Returns false when the file is missing, is not a journal or lacks checkpoint 0.
+    bool open(const std::string& path)
+    {
+        deltas.clear();
+        checkpoints.clear();
+        if (!file.open(path) || file.size() < sizeof(JournalFileHeader)) {
+            file.close();
+            return false;
+        }
+        std::memcpy(&fileHeader, file.data(), sizeof(fileHeader));
+        if (std::memcmp(fileHeader.magic, JournalFileHeader::magicValue, sizeof(fileHeader.magic)) != 0
+            || fileHeader.version != JournalFileHeader::currentVersion || fileHeader.byteOrder != JournalFileHeader::byteOrderValue) {
+            file.close();
+            return false;
+        }
+        const std::filesystem::path directory = std::filesystem::path(path).parent_path();
+        size_t at = sizeof(JournalFileHeader);
+        while (file.size() - at >= sizeof(JournalBlockHeader)) {
+            JournalBlockHeader block;
+            std::memcpy(&block, file.data() + at, sizeof(block));
+            at += sizeof(block);
+            if (file.size() - at < block.size) {
+                break;
+            }
+            const std::byte* payload = file.data() + at;
+            at += block.size;
+            if (block.kind == JournalBlock::Step) {
+                deltas.emplace_back(block.step, std::span<const std::byte>(payload, block.size));
+            } else if (block.kind == JournalBlock::Checkpoint) {
+                checkpoints.emplace_back(block.step, (directory / std::string(reinterpret_cast<const char*>(payload), block.size)).string());
+            }
+        }
+        if (checkpoints.empty() || checkpoints.front().first != 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        file.close();
+        deltas.clear();
+        checkpoints.clear();
+    }
+
+    const JournalFileHeader& header() const
+    {
+        return fileHeader;
+    }
+
+    // The last step the journal reaches.
+    uint64_t lastStep() const
+    {
+        return deltas.empty() ? 0 : deltas.back().first;
+    }
+
+    uint64_t checkpointCount() const
+    {
+        return checkpoints.size();
+    }
+
+    // The records of step, or nothing when the journal lacks it. Valid while the reader is open.
+    bool delta(const uint64_t step, std::span<const std::byte>& records) const
+    {
+        auto it = std::lower_bound(deltas.begin(), deltas.end(), step, [](const auto& d, uint64_t s) { return d.first < s; });
+        if (it == deltas.end() || it->first != step) {
+            return false;
+        }
+        records = it->second;
+        return true;
+    }
+
+    // The last checkpoint at or before step.
+    const std::pair<uint64_t, std::string>& checkpointBefore(const uint64_t step) const
+    {
+        auto it = std::upper_bound(checkpoints.begin(), checkpoints.end(), step, [](uint64_t s, const auto& c) { return s < c.first; });
+        return *(it - 1);
+    }
+
+private:
+    MappedFile file;
+    JournalFileHeader fileHeader = {};
+    std::vector<std::pair<uint64_t, std::span<const std::byte>>> deltas; // in step order
+    std::vector<std::pair<uint64_t, std::string>> checkpoints; // in step order, checkpoint 0 first
+};
+
+// Moves a tree to any step of a journal. Going forward applies the steps in between; going
+// back, or further than the next checkpoint, first loads the nearest checkpoint at or before
+// the step. The tree must have the shape and dimensions the journal was recorded with and
+// must not be changed otherwise while it is scrubbed.
+template <class Topology>
+class JournalReplayer {
+public:
+    JournalReplayer(Topology& topology, const JournalReader& journal)
+        : topology(topology)
+        , journal(journal)
+    {
+    }
+
+    // Returns false when the journal does not reach step, a checkpoint cannot be loaded or a
+    // step does not apply, in which case the tree is left at an unknown step.
+    bool seek(const uint64_t step)
+    {
+        if (step > journal.lastStep()) {
+            return false;
+        }
+        const auto& [checkpointStep, path] = journal.checkpointBefore(step);
+        if (!valid || current > step || current < checkpointStep) {
+            valid = false;
+            if (!topology.load(path)) {
+                return false;
+            }
+            ++checkpointsLoaded;
+            current = checkpointStep;
+            valid = true;
+        }
+        while (current < step) {
+            std::span<const std::byte> records;
+            if (!journal.delta(current + 1, records) || !topology.applyDelta(records)) {
+                valid = false;
+                return false;
+            }
+            ++current;
+            ++stepsApplied;
+        }
+        return true;
+    }
+
+    uint64_t step() const
+    {
+        return current;
+    }
+
+    uint64_t stepsApplied = 0;
+    uint64_t checkpointsLoaded = 0;
+
+private:
+    Topology& topology;
+    const JournalReader& journal;
+    uint64_t current = 0;
+    bool valid = false;
+};
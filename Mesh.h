@@ -0,0 +1,359 @@
+#pragma once
+
+#include "Vector3D.h"
+#include "VoxelSegments.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Greedy merged voxel faces, or a smooth surface with one vertex per boundary cell
+// (surface nets, the dual of marching cubes on the voxel occupancy).
+enum class MeshStyle {
+    Quads,
+    Smooth,
+};
+
+// An indexed triangle mesh. Triangles are wound counter-clockwise seen from outside.
+class Mesh {
+public:
+    Mesh() = default;
+    ~Mesh() = default;
+
+    std::vector<Vector3D<float>> vertices;
+    std::vector<uint32_t> indices;
+
+    size_t triangleCount() const
+    {
+        return indices.size() / 3;
+    }
+
+    void clear()
+    {
+        vertices.clear();
+        indices.clear();
+    }
+
+    void append(const Mesh& mesh)
+    {
+        uint32_t base = (uint32_t)vertices.size();
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        for (uint32_t i : mesh.indices) {
+            indices.push_back(base + i);
+        }
+    }
+
+    // Adds the quad a, b, c, d as two triangles.
+    void addQuad(const Vector3D<float>& a, const Vector3D<float>& b, const Vector3D<float>& c, const Vector3D<float>& d)
+    {
+        uint32_t base = (uint32_t)vertices.size();
+        vertices.push_back(a);
+        vertices.push_back(b);
+        vertices.push_back(c);
+        vertices.push_back(d);
+        addQuad(base, base + 1, base + 2, base + 3);
+    }
+
+    void addQuad(const uint32_t a, const uint32_t b, const uint32_t c, const uint32_t d)
+    {
+        indices.insert(indices.end(), { a, b, c, a, c, d });
+    }
+
+    // Binary STL. Returns false when the file cannot be written.
+    bool saveSTL(const std::string& path) const
+    {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) {
+            return false;
+        }
+        char header[80] = {};
+        std::strncpy(header, "vdb mesh", sizeof(header));
+        out.write(header, sizeof(header));
+        uint32_t count = (uint32_t)triangleCount();
+        out.write((const char*)&count, sizeof(count));
+        for (size_t t = 0; t < indices.size(); t += 3) {
+            const Vector3D<float>& a = vertices[indices[t]];
+            const Vector3D<float>& b = vertices[indices[t + 1]];
+            const Vector3D<float>& c = vertices[indices[t + 2]];
+            Vector3D<float> n = (b - a).cross(c - a);
+            float length = n.length();
+            if (length > 0) {
+                n = n / length;
+            }
+            float facet[12] = { n.x, n.y, n.z, a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z };
+            uint16_t attributes = 0;
+            out.write((const char*)facet, sizeof(facet));
+            out.write((const char*)&attributes, sizeof(attributes));
+        }
+        return (bool)out;
+    }
+
+    // Binary little-endian PLY with shared vertices. Returns false when the file cannot be written.
+    bool savePLY(const std::string& path) const
+    {
+        std::ofstream out(path, std::ios::binary);
+        if (!out) {
+            return false;
+        }
+        out << "ply\n"
+            << "format binary_little_endian 1.0\n"
+            << "element vertex " << vertices.size() << "\n"
+            << "property float x\n"
+            << "property float y\n"
+            << "property float z\n"
+            << "element face " << triangleCount() << "\n"
+            << "property list uchar uint vertex_indices\n"
+            << "end_header\n";
+        for (const auto& v : vertices) {
+            float xyz[3] = { v.x, v.y, v.z };
+            out.write((const char*)xyz, sizeof(xyz));
+        }
+        for (size_t t = 0; t < indices.size(); t += 3) {
+            uint8_t n = 3;
+            out.write((const char*)&n, sizeof(n));
+            out.write((const char*)&indices[t], 3 * sizeof(uint32_t));
+        }
+        return (bool)out;
+    }
+};
+
+// Meshes one brick-sized block of B^3 voxels from its occupancy with a one voxel border.
+// grid holds (B + 2)^3 cells indexed by gridIndex, the block itself at 1..B. Faces and
+// cell vertices are placed at lattice coordinates origin + cell, mapped to p * scale + offset.
+template <uint32_t B>
+class BlockMesher {
+public:
+    static constexpr uint32_t gridEdge = B + 2;
+    static constexpr uint32_t gridSize = gridEdge * gridEdge * gridEdge;
+
+    static constexpr uint32_t gridIndex(const int32_t x, const int32_t y, const int32_t z)
+    {
+        return ((uint32_t)(x + 1) * gridEdge + (uint32_t)(y + 1)) * gridEdge + (uint32_t)(z + 1);
+    }
+
+    static void mesh(const std::array<uint8_t, gridSize>& grid, const Vector3D<uint32_t>& origin, const float scale, const Vector3D<float>& offset, const MeshStyle style, Mesh& out)
+    {
+        // Lattice point origin + (x, y, z) plus a fraction of a voxel. The integer part is summed
+        // exactly first, so neighbouring blocks place a shared vertex at the same position.
+        auto place = [&](int32_t x, int32_t y, int32_t z, float fx, float fy, float fz) {
+            return Vector3D<float>(
+                ((float)((int64_t)origin.x + x) + fx) * scale + offset.x,
+                ((float)((int64_t)origin.y + y) + fy) * scale + offset.y,
+                ((float)((int64_t)origin.z + z) + fz) * scale + offset.z);
+        };
+        if (style == MeshStyle::Quads) {
+            meshQuads(grid, place, out);
+        } else {
+            meshSmooth(grid, place, out);
+        }
+    }
+
+private:
+    // For each face direction and slice, merges exposed faces into maximal rectangles.
+    template <class Place>
+    static void meshQuads(const std::array<uint8_t, gridSize>& grid, const Place& place, Mesh& out)
+    {
+        constexpr int32_t stride[3] = { (int32_t)(gridEdge * gridEdge), (int32_t)gridEdge, 1 };
+        std::array<uint8_t, B * B> mask;
+        for (uint32_t f = 0; f < 6; ++f) {
+            const uint32_t a = f / 2, u = (a + 1) % 3, v = (a + 2) % 3;
+            const int32_t dir = (f % 2) ? 1 : -1;
+            const int32_t step = dir * stride[a];
+            for (int32_t d = 0; d < (int32_t)B; ++d) {
+                bool any = false;
+                for (int32_t i = 0; i < (int32_t)B; ++i) {
+                    const uint8_t* row = &grid[gridIndex(0, 0, 0) + d * stride[a] + i * stride[u]];
+                    for (int32_t j = 0; j < (int32_t)B; ++j) {
+                        const uint8_t* cell = row + j * stride[v];
+                        mask[i * B + j] = cell[0] & (uint8_t)!cell[step];
+                        any |= mask[i * B + j] != 0;
+                    }
+                }
+                if (!any) {
+                    continue;
+                }
+                const int32_t plane = dir > 0 ? d + 1 : d;
+                for (uint32_t i = 0; i < B; ++i) {
+                    for (uint32_t j = 0; j < B;) {
+                        if (!mask[i * B + j]) {
+                            ++j;
+                            continue;
+                        }
+                        uint32_t width = 1;
+                        while (j + width < B && mask[i * B + j + width]) {
+                            ++width;
+                        }
+                        uint32_t height = 1;
+                        while (i + height < B && rowIsSet(mask, i + height, j, width)) {
+                            ++height;
+                        }
+                        for (uint32_t k = 0; k < height; ++k) {
+                            std::memset(&mask[(i + k) * B + j], 0, width);
+                        }
+                        int32_t c[4][3];
+                        const int32_t us[4] = { (int32_t)i, (int32_t)(i + height), (int32_t)(i + height), (int32_t)i };
+                        const int32_t vs[4] = { (int32_t)j, (int32_t)j, (int32_t)(j + width), (int32_t)(j + width) };
+                        for (uint32_t k = 0; k < 4; ++k) {
+                            c[k][a] = plane;
+                            c[k][u] = us[k];
+                            c[k][v] = vs[k];
+                        }
+                        Vector3D<float> c0 = place(c[0][0], c[0][1], c[0][2], 0, 0, 0), c1 = place(c[1][0], c[1][1], c[1][2], 0, 0, 0);
+                        Vector3D<float> c2 = place(c[2][0], c[2][1], c[2][2], 0, 0, 0), c3 = place(c[3][0], c[3][1], c[3][2], 0, 0, 0);
+                        if (dir > 0) {
+                            out.addQuad(c0, c1, c2, c3);
+                        } else {
+                            out.addQuad(c0, c3, c2, c1);
+                        }
+                        j += width;
+                    }
+                }
+            }
+        }
+    }
+
+    static bool rowIsSet(const std::array<uint8_t, B * B>& mask, const uint32_t i, const uint32_t j, const uint32_t width)
+    {
+        for (uint32_t k = 0; k < width; ++k) {
+            if (!mask[i * B + j + k]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // A cell spans the centers of the voxels min..min + 1. Its vertex is the mean of the
+    // midpoints of its edges whose two voxels differ. Every face between an active voxel of
+    // the block and an inactive neighbour becomes the quad of the four cells around it.
+    template <class Place>
+    static void meshSmooth(const std::array<uint8_t, gridSize>& grid, const Place& place, Mesh& out)
+    {
+        constexpr uint32_t cellEdge = B + 1; // cells with min in -1..B - 1
+        std::array<int32_t, cellEdge * cellEdge * cellEdge> cellVertex;
+        cellVertex.fill(-1);
+        auto vertexOf = [&](int32_t x, int32_t y, int32_t z) -> uint32_t {
+            int32_t& slot = cellVertex[((uint32_t)(x + 1) * cellEdge + (uint32_t)(y + 1)) * cellEdge + (uint32_t)(z + 1)];
+            if (slot >= 0) {
+                return (uint32_t)slot;
+            }
+            float sx = 0, sy = 0, sz = 0;
+            uint32_t n = 0;
+            for (uint32_t e = 0; e < 12; ++e) {
+                const uint32_t axis = e / 4;
+                int32_t p[3] = { 0, 0, 0 };
+                p[(axis + 1) % 3] = e & 1;
+                p[(axis + 2) % 3] = (e >> 1) & 1;
+                int32_t q[3] = { p[0], p[1], p[2] };
+                q[axis] = 1;
+                if (grid[gridIndex(x + p[0], y + p[1], z + p[2])] != grid[gridIndex(x + q[0], y + q[1], z + q[2])]) {
+                    sx += (float)(p[0] + q[0]) * 0.5f;
+                    sy += (float)(p[1] + q[1]) * 0.5f;
+                    sz += (float)(p[2] + q[2]) * 0.5f;
+                    ++n;
+                }
+            }
+            // Voxel centers sit half a voxel above the lattice point.
+            slot = (int32_t)out.vertices.size();
+            out.vertices.push_back(place(x, y, z, sx / (float)n + 0.5f, sy / (float)n + 0.5f, sz / (float)n + 0.5f));
+            return (uint32_t)slot;
+        };
+
+        for (int32_t x = 0; x < (int32_t)B; ++x) {
+            for (int32_t y = 0; y < (int32_t)B; ++y) {
+                for (int32_t z = 0; z < (int32_t)B; ++z) {
+                    if (!grid[gridIndex(x, y, z)]) {
+                        continue;
+                    }
+                    const int32_t p[3] = { x, y, z };
+                    for (uint32_t f = 0; f < 6; ++f) {
+                        const uint32_t a = f / 2, u = (a + 1) % 3, v = (a + 2) % 3;
+                        const int32_t dir = (f % 2) ? 1 : -1;
+                        int32_t q[3] = { p[0], p[1], p[2] };
+                        q[a] += dir;
+                        if (grid[gridIndex(q[0], q[1], q[2])]) {
+                            continue;
+                        }
+                        uint32_t corner[4];
+                        const int32_t du[4] = { -1, 0, 0, -1 };
+                        const int32_t dv[4] = { -1, -1, 0, 0 };
+                        for (uint32_t k = 0; k < 4; ++k) {
+                            int32_t c[3];
+                            c[a] = std::min(p[a], q[a]);
+                            c[u] = p[u] + du[k];
+                            c[v] = p[v] + dv[k];
+                            corner[k] = vertexOf(c[0], c[1], c[2]);
+                        }
+                        if (dir > 0) {
+                            out.addQuad(corner[0], corner[1], corner[2], corner[3]);
+                        } else {
+                            out.addQuad(corner[0], corner[3], corner[2], corner[1]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Meshes of the tiles and bricks of a tree, kept per segment key so that an update only
+// re-meshes what changed. The cache follows the tree through its own surface extraction,
+// so like a VoxelSegments it must be the only incremental consumer of its Topology.
+class MeshCache {
+public:
+    MeshCache() = default;
+    ~MeshCache() = default;
+
+    explicit MeshCache(const MeshStyle style)
+        : meshStyle(style)
+    {
+    }
+
+    MeshStyle style() const
+    {
+        return meshStyle;
+    }
+
+    const std::map<uint64_t, Mesh>& meshes() const
+    {
+        return items;
+    }
+
+    size_t triangleCount() const
+    {
+        size_t count = 0;
+        for (const auto& [key, mesh] : items) {
+            count += mesh.triangleCount();
+        }
+        return count;
+    }
+
+    // Concatenates all meshes into one indexed mesh.
+    void gather(Mesh& mesh) const
+    {
+        mesh.clear();
+        for (const auto& [key, m] : items) {
+            mesh.append(m);
+        }
+    }
+
+    // Used by Topology::calculateMesh.
+    VoxelSegments& segments()
+    {
+        return surface;
+    }
+
+    std::map<uint64_t, Mesh>& entries()
+    {
+        return items;
+    }
+
+private:
+    MeshStyle meshStyle = MeshStyle::Quads;
+    VoxelSegments surface;
+    std::map<uint64_t, Mesh> items;
+};
@@ -3,7 +3,7 @@
 #include "Vector3D.h"
 #include <cstdint>
 
-#if _MSC_VER
+#if _MSC_VER || defined(__BMI2__)
 #define USE_BMI2
 #include <immintrin.h>
 #endif
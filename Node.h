@@ -2,18 +2,86 @@
 
 #include "AABB3D.h"
 #include "BBox3D.h"
+#include "Capsule3D.h"
+#include "Journal.h"
 #include "Morton.h"
+#include "NodePool.h"
+#include "Scheduler.h"
+#include "TopologyFile.h"
 #include "Vector3D.h"
+#include "VoxelSegments.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
-#include <execution>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <utility>
 #include <vector>
 
+// Which leaves an extraction emits: every active voxel and tile, or only those with at
+// least one inactive face neighbour.
+enum class Extraction {
+    All,
+    Surface,
+};
+
+// How a brick removes the voxels of a tool: Batch tests every voxel center of a
+// word at once, Span clips each row of voxels against the tool analytically.
+enum class SubtractMode {
+    Batch,
+    Span,
+};
+
+// How many voxels below a node are active, and the box [min, max) in voxel coordinates of
+// the tree that tightly holds them. The box means nothing while count is 0.
+struct ActiveVoxels {
+    uint64_t count = 0;
+    Vector3D<uint32_t> min;
+    Vector3D<uint32_t> max;
+
+    static ActiveVoxels cube(const Vector3D<uint32_t>& origin, const uint32_t edge)
+    {
+        return { (uint64_t)edge * edge * edge, origin, origin + edge };
+    }
+
+    void add(const ActiveVoxels& other)
+    {
+        if (other.count == 0) {
+            return;
+        }
+        if (count == 0) {
+            *this = other;
+            return;
+        }
+        count += other.count;
+        min = Vector3D<uint32_t>(std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z));
+        max = Vector3D<uint32_t>(std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z));
+    }
+};
+
+// The brick-sized cells that lost voxels during a subtraction, reported from all threads
+// by the bricks cut into and the nodes removed whole.
+struct CutTally {
+    struct Cut {
+        Vector3D<uint32_t> origin;
+        std::vector<uint64_t> words; // the removed voxels as brick words, or empty when all of them went
+    };
+
+    void add(const Vector3D<uint32_t>& origin, std::vector<uint64_t> words = {})
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cuts.push_back({ origin, std::move(words) });
+    }
+
+    std::mutex mutex;
+    std::vector<Cut> cuts;
+};
+
 template <class T, uint32_t N>
 class Node {
 public:
@@ -25,17 +93,17 @@ public:
     static constexpr uint32_t maxChildrenCount() { return 1 << (N * 3); }
     static constexpr uint32_t sumN() { return N + T::sumN(); }
 
-    float edgeLengthGL(const uint32_t halfRootEdgeLength)
+    float edgeLengthGL(const uint32_t halfRootEdgeLength) const
     {
         return (float)edgeLength() / (float)halfRootEdgeLength;
     }
 
-    Vector3D<uint32_t> getCoord()
+    Vector3D<uint32_t> getCoord() const
     {
         return Morton::decode((uint64_t)id << (sumN() * 3)) + halfEdgeLength();
     }
 
-    Vector3D<float> getCoordGL(const uint32_t halfRootEdgeLength)
+    Vector3D<float> getCoordGL(const uint32_t halfRootEdgeLength) const
     {
         Vector3D<uint32_t> coord = getCoord();
         return {
@@ -45,17 +113,40 @@ public:
         };
     }
 
-    AABB3D<float> getBBoxGL(const uint32_t halfRootEdgeLength)
+    AABB3D<float> getBBoxGL(const uint32_t halfRootEdgeLength) const
     {
         return AABB3D<float>(getCoordGL(halfRootEdgeLength), edgeLengthGL(halfRootEdgeLength) / 2.0f);
     }
 
-    uint64_t calChildId(uint32_t i)
+    uint64_t calChildId(uint32_t i) const
     {
         return (uint64_t)i | (id << (3 * N));
     }
 
-    bool isAllVertexInside(const std::function<bool(const Vector3D<float>&)>& isInside, const uint32_t halfRootEdgeLength)
+    // Morton index of the first voxel of the node, and the number of voxels it spans.
+    uint64_t firstVoxel() const
+    {
+        return id << (sumN() * 3);
+    }
+
+    static constexpr uint64_t voxelCount()
+    {
+        return 1ull << (sumN() * 3);
+    }
+
+    // Voxel coordinates of the lowest corner of the node.
+    Vector3D<uint32_t> getOrigin() const
+    {
+        return Morton::decode(firstVoxel());
+    }
+
+    uint64_t segmentKey() const
+    {
+        return VoxelSegments::key(firstVoxel(), sumN());
+    }
+
+    template <class F>
+    bool isAllVertexInside(const F& isInside, const uint32_t halfRootEdgeLength)
     {
         for (int8_t i = -1; i <= 1; i += 2) {
             for (int8_t j = -1; j <= 1; j += 2) {
@@ -71,9 +162,21 @@ public:
         return true;
     }
 
+    ActiveVoxels activeVoxels() const
+    {
+        return isActive ? counted : ActiveVoxels();
+    }
+
     uint64_t id = 0;
     bool isActive = true;
     bool hasChildren = false;
+    // Set by every operation that may change the leaves below the node, cleared by the incremental extraction.
+    bool isDirty = true;
+    // The active voxels below the node, taking it as active: all of them for a tile, set when
+    // the tile is made. Every change below a subdivided node is folded into the counts on the
+    // way to the root.
+    ActiveVoxels counted;
+    NodeRefCount refs;
 };
 
 template <class T, uint32_t N>
@@ -94,9 +197,10 @@ public:
         }
         this->subdivide();
 
-        std::for_each(std::execution::par, this->children.begin(), this->children.end(), [&](auto& c) {
-            c->initialize(bbox, halfRootEdgeLength);
+        Scheduler::instance().parallelFor(0, Node<T, N>::maxChildrenCount(), [&](uint32_t i) {
+            children[i]->initialize(bbox, halfRootEdgeLength);
         });
+        recount();
     }
 
     void reset()
@@ -106,47 +210,241 @@ public:
         }
         this->isActive = true;
         this->hasChildren = false;
+        this->isDirty = true;
+        this->counted = ActiveVoxels::cube(this->getOrigin(), this->edgeLength());
     }
 
     void subdivide()
     {
         this->hasChildren = true;
-        std::for_each(std::execution::par, this->children.begin(), this->children.end(), [&](auto& c) {
-            uint32_t i = &c - this->children.data();
-            c = std::make_unique<T>();
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            auto& c = children[i];
+            c = NodePool<T>::make();
             c->id = this->calChildId(i);
             c->isActive = true;
             c->hasChildren = false;
-        });
+            c->isDirty = true;
+            c->counted = ActiveVoxels::cube(c->getOrigin(), T::edgeLength());
+        }
+        this->counted = ActiveVoxels::cube(this->getOrigin(), this->edgeLength());
     }
 
-    void subtract(const BBox3D<float>& bbox, const std::function<bool(const Vector3D<float>&)>& isInside, const uint32_t halfRootEdgeLength)
+    void subtract(const BBox3D<float>& bbox, const std::function<bool(const Vector3D<float>&)>& isInside, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
     {
         if (!bbox.intersects(this->getBBoxGL(halfRootEdgeLength))) {
             return;
         }
+        this->isDirty = true;
         if (this->isAllVertexInside(isInside, halfRootEdgeLength)) {
+            reportRemoved(tally);
             this->isActive = false;
             return;
         }
         if (!this->hasChildren) {
             this->subdivide();
         }
-        std::for_each(std::execution::par, this->children.begin(), this->children.end(), [&](auto& c) {
-            if (c != nullptr && c->isActive) {
-                c->subtract(bbox, isInside, halfRootEdgeLength);
+        Cuts cuts;
+        Scheduler::instance().parallelFor(0, Node<T, N>::maxChildrenCount(), [&](uint32_t i) {
+            T* c = writable(i, [&](const T& child) {
+                return bbox.intersects(child.getBBoxGL(halfRootEdgeLength));
+            });
+            if (c != nullptr) {
+                const ActiveVoxels before = c->activeVoxels();
+                c->subtract(bbox, isInside, halfRootEdgeLength, tally);
+                noteCut(cuts, before, c->activeVoxels());
+            }
+        });
+        recount(cuts);
+    }
+
+    // Shape is a Capsule3D or Sweep3D in GL coordinates. What is removed is reported to tally
+    // when one is given.
+    template <class Shape>
+    void subtract(const Shape& tool, const SubtractMode mode, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
+    {
+        switch (tool.classify(this->getBBoxGL(halfRootEdgeLength))) {
+        case Overlap::Outside:
+            return;
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return;
+        case Overlap::Partial:
+            break;
+        }
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            this->subdivide();
+        }
+        Cuts cuts;
+        Scheduler::instance().parallelFor(0, Node<T, N>::maxChildrenCount(), [&](uint32_t i) {
+            T* c = writable(i, [&](const T& child) {
+                return tool.classify(child.getBBoxGL(halfRootEdgeLength)) != Overlap::Outside;
+            });
+            if (c != nullptr) {
+                const ActiveVoxels before = c->activeVoxels();
+                c->subtract(tool, mode, halfRootEdgeLength, tally);
+                noteCut(cuts, before, c->activeVoxels());
+            }
+        });
+        recount(cuts);
+    }
+
+    // Removes several tool postures in GL coordinates in one descent. Each subtree only
+    // receives the postures that partially cover it.
+    void subtract(std::span<const Capsule3D<float>> tools, const SubtractMode mode, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
+    {
+        std::vector<Capsule3D<float>> partial;
+        switch (Capsule3D<float>::classify(tools, this->getBBoxGL(halfRootEdgeLength), partial)) {
+        case Overlap::Outside:
+            return;
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return;
+        case Overlap::Partial:
+            break;
+        }
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            this->subdivide();
+        }
+        Cuts cuts;
+        Scheduler::instance().parallelFor(0, Node<T, N>::maxChildrenCount(), [&](uint32_t i) {
+            T* c = writable(i, [&](const T& child) {
+                return std::any_of(partial.begin(), partial.end(), [&](const Capsule3D<float>& tool) {
+                    return tool.classify(child.getBBoxGL(halfRootEdgeLength)) != Overlap::Outside;
+                });
+            });
+            if (c != nullptr) {
+                const ActiveVoxels before = c->activeVoxels();
+                c->subtract(std::span<const Capsule3D<float>>(partial), mode, halfRootEdgeLength, tally);
+                noteCut(cuts, before, c->activeVoxels());
+            }
+        });
+        recount(cuts);
+    }
+
+    // First pass of a resumable subtract: removes the nodes the tool covers and lists the
+    // first voxel of every brick it cuts into, leaving the bricks themselves untouched.
+    template <class Shape>
+    void collectBricks(const Shape& tool, const uint32_t halfRootEdgeLength, std::vector<uint64_t>& bricks, CutTally* tally = nullptr)
+    {
+        switch (tool.classify(this->getBBoxGL(halfRootEdgeLength))) {
+        case Overlap::Outside:
+            return;
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return;
+        case Overlap::Partial:
+            break;
+        }
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            this->subdivide();
+        }
+        Cuts cuts;
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            T* c = writable(i, [&](const T& child) {
+                return tool.classify(child.getBBoxGL(halfRootEdgeLength)) != Overlap::Outside;
+            });
+            if (c != nullptr) {
+                const ActiveVoxels before = c->activeVoxels();
+                c->collectBricks(tool, halfRootEdgeLength, bricks, tally);
+                noteCut(cuts, before, c->activeVoxels());
             }
+        }
+        recount(cuts);
+    }
+
+    // Walks down to the brick starting at firstVoxel as subtract would, and returns it when
+    // the tool still has to cut into it. The tree may have changed since collectBricks.
+    template <class Shape>
+    auto reachBrick(const Shape& tool, const uint64_t firstVoxel, const uint32_t halfRootEdgeLength, CutTally* tally = nullptr)
+    {
+        using BrickPtr = decltype(children[0]->reachBrick(tool, firstVoxel, halfRootEdgeLength));
+        switch (tool.classify(this->getBBoxGL(halfRootEdgeLength))) {
+        case Overlap::Outside:
+            return BrickPtr(nullptr);
+        case Overlap::Inside:
+            reportRemoved(tally);
+            this->isActive = false;
+            this->isDirty = true;
+            return BrickPtr(nullptr);
+        case Overlap::Partial:
+            break;
+        }
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            this->subdivide();
+        }
+        T* c = writable((firstVoxel >> (T::sumN() * 3)) & (Node<T, N>::maxChildrenCount() - 1), [&](const T& child) {
+            return tool.classify(child.getBBoxGL(halfRootEdgeLength)) != Overlap::Outside;
         });
+        if (c == nullptr) {
+            return BrickPtr(nullptr);
+        }
+        const ActiveVoxels before = c->activeVoxels();
+        BrickPtr brick = c->reachBrick(tool, firstVoxel, halfRootEdgeLength, tally);
+        recount(before, c->activeVoxels());
+        return brick;
+    }
+
+    // Reports every active voxel below the node to tally, when there is one, as the node is
+    // about to be removed whole.
+    void reportRemoved(CutTally* tally) const
+    {
+        if (tally == nullptr) {
+            return;
+        }
+        if (!this->hasChildren) {
+            reportSolid(*tally, this->getOrigin());
+            return;
+        }
+        for (const auto& c : children) {
+            if (c != nullptr && c->isActive) {
+                c->reportRemoved(tally);
+            }
+        }
+    }
+
+    // Reports the cells of a solid node at origin.
+    static void reportSolid(CutTally& tally, const Vector3D<uint32_t>& origin)
+    {
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            T::reportSolid(tally, origin + Morton::decode(i) * T::edgeLength());
+        }
+    }
+
+    // Folds the cut of the brick starting at firstVoxel, which held brickBefore until then, into
+    // the counts on the way to it, which reachBrick made writable. Returns what the node held
+    // before.
+    ActiveVoxels recount(const uint64_t firstVoxel, const ActiveVoxels& brickBefore)
+    {
+        const ActiveVoxels before = this->activeVoxels();
+        const auto& c = children[(firstVoxel >> (T::sumN() * 3)) & (Node<T, N>::maxChildrenCount() - 1)];
+        if (this->hasChildren && c != nullptr) {
+            const ActiveVoxels childBefore = c->recount(firstVoxel, brickBefore);
+            recount(childBefore, c->activeVoxels());
+        }
+        return before;
     }
 
-    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const uint32_t halfRootEdgeLength)
+    // Inactive children are released on the way, unless the node is shared with another tree
+    // version, which may be read from another thread.
+    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const uint32_t halfRootEdgeLength, bool shared = false)
     {
+        shared = shared || this->refs.count.load(std::memory_order_acquire) > 1;
         if (this->hasChildren) {
             for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
                 if (children[i] != nullptr) {
                     if (children[i]->isActive) {
-                        children[i]->calculateVoxels(coords, sizes, halfRootEdgeLength);
-                    } else {
+                        children[i]->calculateVoxels(coords, sizes, halfRootEdgeLength, shared);
+                    } else if (!shared) {
                         children[i].reset();
                     }
                 }
@@ -157,5 +455,513 @@ public:
         }
     }
 
-    std::array<std::unique_ptr<T>, Node<T, N>::maxChildrenCount()> children = { nullptr };
+    // Re-emits the leaves below dirty nodes only, one segment per tile or brick. Segments of
+    // subtrees that were removed or merged into a tile are dropped. With a surface lookup only
+    // the exposed leaves are emitted. Inactive children are released as by the full extraction.
+    template <class Surface>
+    void calculateVoxels(VoxelSegments& segments, const uint32_t halfRootEdgeLength, const Surface* surface, bool shared = false)
+    {
+        if (!this->isDirty) {
+            return;
+        }
+        this->isDirty = false;
+        shared = shared || this->refs.count.load(std::memory_order_acquire) > 1;
+        if (!this->hasChildren) {
+            segments.removeRange(this->firstVoxel(), this->voxelCount(), this->segmentKey());
+            if (surface != nullptr && !surface->isExposed(this->getOrigin(), this->edgeLength())) {
+                segments.remove(this->segmentKey());
+                return;
+            }
+            VoxelSegment& segment = segments.write(this->segmentKey());
+            segment.coords.push_back(Node<T, N>::getCoordGL(halfRootEdgeLength));
+            segment.sizes.push_back(Node<T, N>::edgeLengthGL(halfRootEdgeLength));
+            return;
+        }
+        segments.remove(this->segmentKey());
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            auto& c = children[i];
+            if (c != nullptr && c->isActive) {
+                c->calculateVoxels(segments, halfRootEdgeLength, surface, shared);
+                continue;
+            }
+            segments.removeRange(this->calChildId(i) << (T::sumN() * 3), T::voxelCount());
+            if (!shared) {
+                c.reset();
+            }
+        }
+    }
+
+    // Emits only the leaves with an inactive face neighbour, found through surface.
+    template <class Surface>
+    void calculateSurfaceVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const uint32_t halfRootEdgeLength, const Surface& surface) const
+    {
+        if (!this->hasChildren) {
+            if (surface.isExposed(this->getOrigin(), this->edgeLength())) {
+                coords.push_back(Node<T, N>::getCoordGL(halfRootEdgeLength));
+                sizes.push_back(Node<T, N>::edgeLengthGL(halfRootEdgeLength));
+            }
+            return;
+        }
+        for (const auto& c : children) {
+            if (c != nullptr && c->isActive) {
+                c->calculateSurfaceVoxels(coords, sizes, halfRootEdgeLength, surface);
+            }
+        }
+    }
+
+    // Appends every leaf below the node in Morton order: a tile as { nullptr, firstVoxel, level },
+    // a brick through Brick::collectLeaves.
+    template <class Runs>
+    void collectLeaves(Runs& runs) const
+    {
+        if (!this->hasChildren) {
+            runs.push_back({ nullptr, this->firstVoxel(), Node<T, N>::sumN() });
+            return;
+        }
+        for (const auto& c : children) {
+            if (c != nullptr && c->isActive) {
+                c->collectLeaves(runs);
+            }
+        }
+    }
+
+    // Appends the origin and edge length of every dirty leaf and of every child deactivated
+    // since the last extraction, whose neighbours may have become exposed.
+    void collectDirty(std::vector<std::pair<Vector3D<uint32_t>, uint32_t>>& boxes) const
+    {
+        if (!this->isDirty) {
+            return;
+        }
+        if (!this->hasChildren) {
+            boxes.emplace_back(this->getOrigin(), this->edgeLength());
+            return;
+        }
+        for (const auto& c : children) {
+            if (c == nullptr) {
+                continue;
+            }
+            if (c->isActive) {
+                c->collectDirty(boxes);
+            } else {
+                boxes.emplace_back(c->getOrigin(), T::edgeLength());
+            }
+        }
+    }
+
+    // Marks every leaf overlapping [min, max), given in voxel coordinates of the tree, dirty.
+    void markDirty(const Vector3D<uint32_t>& min, const Vector3D<uint32_t>& max)
+    {
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            return;
+        }
+        forEachChildIn(min, max, [&](auto& c, const Vector3D<uint32_t>& cmin, const Vector3D<uint32_t>& cmax) {
+            if (c != nullptr) {
+                c->markDirty(cmin, cmax);
+            }
+            return true;
+        });
+    }
+
+    // Marks dirty whatever differs from before, another version of the node that shares its
+    // unchanged subtrees with this one.
+    void markChanged(const NodeWithChildren& before)
+    {
+        this->isDirty = true;
+        if (!this->hasChildren) {
+            return;
+        }
+        if (!before.hasChildren) {
+            markDirty(this->getOrigin(), this->getOrigin() + this->edgeLength());
+            return;
+        }
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            const auto& c = children[i];
+            const auto& b = before.children[i];
+            // An inactive child is dropped by its dirty parent.
+            if (c.get() == b.get() || c == nullptr || !c->isActive) {
+                continue;
+            }
+            if (b == nullptr || !b->isActive) {
+                c->markDirty(c->getOrigin(), c->getOrigin() + T::edgeLength());
+            } else {
+                c->markChanged(*b);
+            }
+        }
+    }
+
+    // Writes what turns before into this node, as delta records parent first. before is another
+    // version of the node sharing its unchanged subtrees with this one, or nullptr when the node
+    // was a solid tile. Only the subtrees whose pointers differ are visited.
+    void writeDelta(const NodeWithChildren* before, DeltaWriter& out) const
+    {
+        if (before == nullptr) {
+            out.subdivide(Node<T, N>::sumN(), this->id);
+        }
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            const auto& c = children[i];
+            const T* b = before != nullptr ? before->children[i].get() : nullptr;
+            if (before != nullptr && c.get() == b) {
+                continue;
+            }
+            const bool wasActive = before == nullptr || (b != nullptr && b->isActive);
+            if (c == nullptr || !c->isActive) {
+                if (wasActive) {
+                    out.deactivate(T::sumN(), this->calChildId(i));
+                }
+                continue;
+            }
+            const T* wasSubdivided = wasActive && b != nullptr && b->hasChildren ? b : nullptr;
+            if (!wasActive || (wasSubdivided != nullptr && !c->hasChildren)) {
+                out.tile(T::sumN(), this->calChildId(i));
+                wasSubdivided = nullptr;
+            }
+            if (c->hasChildren) {
+                c->writeDelta(wasSubdivided, out);
+            }
+        }
+    }
+
+    // Applies a record below the node: Words to the brick it names, the others to the slot of
+    // the node it names. Shared nodes on the way are copied first. Returns false when the record
+    // does not fit the tree.
+    bool applyDelta(const DeltaRecord& record)
+    {
+        if (record.level >= Node<T, N>::sumN() || !this->hasChildren || record.id >> ((Node<T, N>::sumN() - record.level) * 3) != this->id) {
+            return false;
+        }
+        this->isDirty = true;
+        const uint32_t i = (record.firstVoxel() >> (T::sumN() * 3)) & (Node<T, N>::maxChildrenCount() - 1);
+        auto& c = children[i];
+        if (record.level == T::sumN() && record.op != DeltaOp::Words) {
+            if (record.op == DeltaOp::Tile) {
+                const ActiveVoxels before = c != nullptr ? c->activeVoxels() : ActiveVoxels();
+                c = NodePool<T>::make();
+                c->id = this->calChildId(i);
+                c->counted = ActiveVoxels::cube(c->getOrigin(), T::edgeLength());
+                recount(before, c->activeVoxels());
+                return true;
+            }
+            if (c == nullptr || !c->isActive || (record.op == DeltaOp::Subdivide && c->hasChildren)) {
+                return false;
+            }
+            if (c.isShared()) {
+                c = NodePool<T>::make(*c);
+            }
+            c->isDirty = true;
+            if (record.op == DeltaOp::Deactivate) {
+                recount(c->activeVoxels(), ActiveVoxels());
+                c->isActive = false;
+            } else {
+                c->subdivide();
+            }
+            return true;
+        }
+        if (c == nullptr || !c->isActive) {
+            return false;
+        }
+        if (c.isShared()) {
+            c = NodePool<T>::make(*c);
+        }
+        const ActiveVoxels before = c->activeVoxels();
+        const bool applied = c->applyDelta(record);
+        recount(before, c->activeVoxels());
+        return applied;
+    }
+
+    // True when every voxel of [min, max), given in voxel coordinates of the tree, is active.
+    bool isSolid(const Vector3D<uint32_t>& min, const Vector3D<uint32_t>& max) const
+    {
+        if (!this->hasChildren) {
+            return true;
+        }
+        return forEachChildIn(min, max, [&](const auto& c, const Vector3D<uint32_t>& cmin, const Vector3D<uint32_t>& cmax) {
+            return c != nullptr && c->isActive && c->isSolid(cmin, cmax);
+        });
+    }
+
+    // Appends the record of the node to level depth of a saved tree, then the records of its subdivided children.
+    void save(TopologyWriter& out, const uint32_t depth) const
+    {
+        constexpr uint32_t maskWords = TopologyWriter::maskWords(Node<T, N>::maxChildrenCount());
+        uint64_t* record = out.append(depth, 1 + 2 * maskWords);
+        record[0] = out.count(depth + 1);
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            const auto& c = children[i];
+            if (c != nullptr && c->isActive) {
+                record[1 + i / 64] |= 1ull << (i % 64);
+                if (c->hasChildren) {
+                    record[1 + maskWords + i / 64] |= 1ull << (i % 64);
+                }
+            }
+        }
+        for (const auto& c : children) {
+            if (c != nullptr && c->isActive && c->hasChildren) {
+                c->save(out, depth + 1);
+            }
+        }
+    }
+
+    // Rebuilds the subtree from record index at level depth of a saved tree.
+    template <class Image>
+    void load(const Image& image, const uint32_t depth, const uint64_t index)
+    {
+        constexpr uint32_t maskWords = TopologyWriter::maskWords(Node<T, N>::maxChildrenCount());
+        this->isActive = true;
+        this->isDirty = true;
+        this->subdivide();
+        const uint64_t* record = image.record(depth, index);
+        uint64_t next = record[0];
+        for (uint32_t i = 0; i < Node<T, N>::maxChildrenCount(); ++i) {
+            auto& c = children[i];
+            c->isActive = (record[1 + i / 64] >> (i % 64)) & 1;
+            if (c->isActive && ((record[1 + maskWords + i / 64] >> (i % 64)) & 1)) {
+                c->load(image, depth + 1, next++);
+            }
+        }
+        recount();
+    }
+
+    // The brick holding voxel p, or nullptr with solid telling whether p lies in a tile or in empty space.
+    auto findBrick(const Vector3D<uint32_t>& p, bool& solid) const
+    {
+        using BrickPtr = decltype(children[0]->findBrick(p, solid));
+        if (!this->hasChildren) {
+            solid = true;
+            return BrickPtr(nullptr);
+        }
+        const uint32_t mask = (1u << N) - 1;
+        const auto& c = children[Morton::encode((p.x >> T::sumN()) & mask, (p.y >> T::sumN()) & mask, (p.z >> T::sumN()) & mask)];
+        if (c == nullptr || !c->isActive) {
+            solid = false;
+            return BrickPtr(nullptr);
+        }
+        return c->findBrick(p, solid);
+    }
+
+    // The active voxels below the node, taking the node itself as active. Read from the counts,
+    // without a walk.
+    uint64_t countVoxels() const
+    {
+        return this->hasChildren ? this->counted.count : Node<T, N>::voxelCount();
+    }
+
+    // Releases removed children and lets the bricks below pick their smallest encoding. A node
+    // shared with another tree version is left alone, as another thread may read it.
+    void compact(bool shared = false)
+    {
+        shared = shared || this->refs.count.load(std::memory_order_acquire) > 1;
+        if (shared || !this->hasChildren) {
+            return;
+        }
+        Scheduler::instance().parallelFor(0, Node<T, N>::maxChildrenCount(), [&](uint32_t i) {
+            auto& c = children[i];
+            if (c == nullptr) {
+                return;
+            }
+            if (!c->isActive) {
+                c.reset();
+                return;
+            }
+            c->compact();
+        });
+    }
+
+    // Merges the children of dirty nodes back into the node, bottom-up: removed children are
+    // released, the node is removed once none of its children is active, and becomes a tile
+    // once all of them are solid tiles. Clean subtrees are skipped, so it runs before the
+    // incremental extraction clears the dirty flags. A shared child is copied first, but only
+    // when something below it merges.
+    void prune()
+    {
+        if (!this->isDirty || !this->hasChildren) {
+            return;
+        }
+        Scheduler::instance().parallelFor(0, Node<T, N>::maxChildrenCount(), [&](uint32_t i) {
+            T* c = writable(i, [](const T& child) {
+                return child.canPrune();
+            });
+            if (c != nullptr) {
+                c->prune();
+            }
+        });
+        bool anyActive = false, allSolid = true;
+        for (auto& c : children) {
+            const bool active = c != nullptr && c->isActive;
+            if (!active) {
+                c.reset();
+            }
+            anyActive = anyActive || active;
+            allSolid = allSolid && active && !c->hasChildren;
+        }
+        if (anyActive && !allSolid) {
+            return;
+        }
+        for (auto& c : children) {
+            c.reset();
+        }
+        this->hasChildren = false;
+        this->isActive = anyActive;
+    }
+
+    // Whether prune would merge anything at or below the node.
+    bool canPrune() const
+    {
+        if (!this->isDirty || !this->hasChildren) {
+            return false;
+        }
+        bool anyActive = false, allSolid = true;
+        for (const auto& c : children) {
+            const bool active = c != nullptr && c->isActive;
+            if (active && c->canPrune()) {
+                return true;
+            }
+            anyActive = anyActive || active;
+            allSolid = allSolid && active && !c->hasChildren;
+        }
+        return !anyActive || allSolid;
+    }
+
+    template <class Stats>
+    void collectStorage(Stats& stats) const
+    {
+        for (const auto& c : children) {
+            if (c != nullptr) {
+                c->collectStorage(stats);
+            }
+        }
+    }
+
+    std::array<typename NodePool<T>::Ptr, Node<T, N>::maxChildrenCount()> children = { nullptr };
+
+private:
+    // What the children lost during one loop of cuts, and whether one of them pulled back from
+    // a bound of the node, which then has to be found again.
+    struct Cuts {
+        std::atomic<uint64_t> removed = 0;
+        std::atomic<bool> boundsMoved = false;
+    };
+
+    // Notes the cut of a child that held before and holds after now. Cuts only remove voxels.
+    void noteCut(Cuts& cuts, const ActiveVoxels& before, const ActiveVoxels& after) const
+    {
+        if (after.count == before.count) {
+            return;
+        }
+        cuts.removed.fetch_add(before.count - after.count, std::memory_order_relaxed);
+        if (movesBounds(before, after)) {
+            cuts.boundsMoved.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void recount(const Cuts& cuts)
+    {
+        if (cuts.boundsMoved.load(std::memory_order_relaxed)) {
+            recount();
+            return;
+        }
+        this->counted.count -= cuts.removed.load(std::memory_order_relaxed);
+    }
+
+    // Folds the change of one child from before to after into the count. The bounds grow with
+    // the child, but are only summed again when the child pulled back from one of them.
+    void recount(const ActiveVoxels& before, const ActiveVoxels& after)
+    {
+        if (before.count == 0 && after.count == 0) {
+            return;
+        }
+        if (movesBounds(before, after)) {
+            recount();
+            return;
+        }
+        const uint64_t rest = this->counted.count - before.count;
+        if (rest == 0) {
+            this->counted = after;
+            return;
+        }
+        this->counted.count = rest;
+        this->counted.add(after);
+    }
+
+    // Whether a child going from before to after leaves a bound of the node that it reached.
+    bool movesBounds(const ActiveVoxels& before, const ActiveVoxels& after) const
+    {
+        if (before.count == 0) {
+            return false;
+        }
+        const ActiveVoxels& bounds = this->counted;
+        if (after.count == 0) {
+            return before.min.x == bounds.min.x || before.min.y == bounds.min.y || before.min.z == bounds.min.z
+                || before.max.x == bounds.max.x || before.max.y == bounds.max.y || before.max.z == bounds.max.z;
+        }
+        return (before.min.x == bounds.min.x && after.min.x != before.min.x) || (before.min.y == bounds.min.y && after.min.y != before.min.y)
+            || (before.min.z == bounds.min.z && after.min.z != before.min.z) || (before.max.x == bounds.max.x && after.max.x != before.max.x)
+            || (before.max.y == bounds.max.y && after.max.y != before.max.y) || (before.max.z == bounds.max.z && after.max.z != before.max.z);
+    }
+
+    // Sums the counts of the children again.
+    void recount()
+    {
+        ActiveVoxels sum;
+        for (const auto& c : children) {
+            if (c != nullptr) {
+                sum.add(c->activeVoxels());
+            }
+        }
+        this->counted = sum;
+    }
+
+    // The active child in slot i, ready to be changed, or nullptr. A child still held by another
+    // tree version is copied first, but only when touches(child) says the change reaches it.
+    template <class Touches>
+    T* writable(const uint32_t i, const Touches& touches)
+    {
+        auto& c = children[i];
+        if (c == nullptr || !c->isActive) {
+            return nullptr;
+        }
+        if (c.isShared()) {
+            if (!touches(*c)) {
+                return nullptr;
+            }
+            c = NodePool<T>::make(*c);
+        }
+        return c.get();
+    }
+
+    // Calls f(child, childMin, childMax) for every child slot overlapping [min, max), with the box
+    // clipped to the child, until f returns false. Returns false when it stopped early.
+    template <class Self, class F>
+    static bool forEachChildIn(Self& self, const Vector3D<uint32_t>& min, const Vector3D<uint32_t>& max, const F& f)
+    {
+        const uint32_t shift = T::sumN();
+        const uint32_t mask = (1u << N) - 1;
+        const uint32_t e = T::edgeLength();
+        const Vector3D<uint32_t> origin = self.getOrigin();
+        for (uint32_t cx = (min.x >> shift) & mask; cx <= ((max.x - 1) >> shift & mask); ++cx) {
+            for (uint32_t cy = (min.y >> shift) & mask; cy <= ((max.y - 1) >> shift & mask); ++cy) {
+                for (uint32_t cz = (min.z >> shift) & mask; cz <= ((max.z - 1) >> shift & mask); ++cz) {
+                    Vector3D<uint32_t> lo(origin.x + cx * e, origin.y + cy * e, origin.z + cz * e);
+                    Vector3D<uint32_t> cmin(std::max(min.x, lo.x), std::max(min.y, lo.y), std::max(min.z, lo.z));
+                    Vector3D<uint32_t> cmax(std::min(max.x, lo.x + e), std::min(max.y, lo.y + e), std::min(max.z, lo.z + e));
+                    if (!f(self.children[Morton::encode(cx, cy, cz)], cmin, cmax)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    template <class F>
+    bool forEachChildIn(const Vector3D<uint32_t>& min, const Vector3D<uint32_t>& max, const F& f)
+    {
+        return forEachChildIn(*this, min, max, f);
+    }
+
+    template <class F>
+    bool forEachChildIn(const Vector3D<uint32_t>& min, const Vector3D<uint32_t>& max, const F& f) const
+    {
+        return forEachChildIn(*this, min, max, f);
+    }
 };
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+struct NodePoolStats {
+    uint64_t live = 0; // nodes currently in use
+    uint64_t highWater = 0; // largest number of nodes in use at once
+    uint64_t capacity = 0; // node slots owned by the pool, used or free
+    uint64_t slabs = 0;
+    size_t nodeSize = 0;
+};
+
+// The number of tree versions holding a node. A copy of a node starts out unshared.
+struct NodeRefCount {
+    NodeRefCount() = default;
+    NodeRefCount(const NodeRefCount&) { }
+    NodeRefCount& operator=(const NodeRefCount&)
+    {
+        return *this;
+    }
+
+    std::atomic<uint32_t> count = 0;
+};
+
+// Recycles the nodes of one tree level. Slots are carved out of slabs and handed
+// out through a small per-thread free list, so subdivide and reset inside the
+// parallel loops only touch the shared free list once per batch.
+// The live count is published once per batch as well, so stats() may lag
+// behind by up to one batch per thread.
+template <class T>
+class NodePool {
+public:
+    // Holds a node, possibly together with other tree versions. A node held more than once
+    // is copied before it is changed, see NodeWithChildren::writable. T keeps the count in a
+    // NodeRefCount member named refs.
+    class Ptr {
+    public:
+        Ptr() = default;
+        Ptr(std::nullptr_t) { }
+
+        explicit Ptr(T* node)
+            : p(node)
+        {
+            if (p != nullptr) {
+                p->refs.count.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        Ptr(const Ptr& other)
+            : Ptr(other.p)
+        {
+        }
+
+        Ptr(Ptr&& other) noexcept
+            : p(std::exchange(other.p, nullptr))
+        {
+        }
+
+        Ptr& operator=(Ptr other) noexcept
+        {
+            std::swap(p, other.p);
+            return *this;
+        }
+
+        ~Ptr()
+        {
+            reset();
+        }
+
+        void reset() noexcept
+        {
+            if (p != nullptr && p->refs.count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                NodePool<T>::destroy(p);
+            }
+            p = nullptr;
+        }
+
+        bool isShared() const
+        {
+            return p != nullptr && p->refs.count.load(std::memory_order_acquire) > 1;
+        }
+
+        T* get() const
+        {
+            return p;
+        }
+
+        T* operator->() const
+        {
+            return p;
+        }
+
+        T& operator*() const
+        {
+            return *p;
+        }
+
+        friend bool operator==(const Ptr& a, std::nullptr_t)
+        {
+            return a.p == nullptr;
+        }
+
+    private:
+        T* p = nullptr;
+    };
+
+    // A new node, constructed from args; make(node) copies a node for copy-on-write.
+    template <class... Args>
+    static Ptr make(Args&&... args)
+    {
+        LocalCache& cache = local();
+        if (cache.free.empty()) {
+            refill(cache);
+        }
+        void* slot = cache.free.back();
+        cache.free.pop_back();
+        if (++cache.liveDelta >= (int64_t)batchSize) {
+            publish(cache);
+        }
+        return Ptr(new (slot) T(std::forward<Args>(args)...));
+    }
+
+    static void destroy(T* p) noexcept
+    {
+        p->~T();
+        LocalCache& cache = local();
+        cache.free.push_back(p);
+        if (--cache.liveDelta <= -(int64_t)batchSize) {
+            publish(cache);
+        }
+        if (cache.free.size() >= 2 * batchSize) {
+            flush(cache, batchSize);
+        }
+    }
+
+    static NodePoolStats stats()
+    {
+        publish(local());
+        Global& g = global();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        NodePoolStats s;
+        s.live = (uint64_t)std::max<int64_t>(g.live.load(std::memory_order_relaxed), 0);
+        s.highWater = (uint64_t)g.highWater.load(std::memory_order_relaxed);
+        s.capacity = g.slabs.size() * slabSize;
+        s.slabs = g.slabs.size();
+        s.nodeSize = sizeof(T);
+        return s;
+    }
+
+    // Returns every slab to the system. Only has an effect once no node of this
+    // level is alive anymore, and must not run concurrently with tree operations.
+    // The counts every thread has not published yet are added in, so that a node
+    // made or copied on a worker keeps its slab.
+    static void trim()
+    {
+        local();
+        Global& g = global();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        int64_t live = g.live.load(std::memory_order_relaxed);
+        for (const LocalCache* cache : g.caches) {
+            live += cache->liveDelta;
+        }
+        if (live > 0) {
+            return;
+        }
+        for (void* slab : g.slabs) {
+            ::operator delete(slab, std::align_val_t(alignof(T)));
+        }
+        g.slabs.clear();
+        g.free.clear();
+        g.generation.fetch_add(1, std::memory_order_relaxed);
+        for (LocalCache* cache : g.caches) {
+            g.live.fetch_add(cache->liveDelta, std::memory_order_relaxed);
+            cache->liveDelta = 0;
+            cache->free.clear();
+            cache->generation = g.generation.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static constexpr size_t slabSize = 64;
+    static constexpr size_t batchSize = 32;
+
+    struct LocalCache;
+
+    struct Global {
+        std::mutex mutex;
+        std::vector<void*> free;
+        std::vector<void*> slabs;
+        std::atomic<int64_t> live = 0;
+        std::atomic<int64_t> highWater = 0;
+        std::atomic<uint64_t> generation = 0;
+        std::vector<LocalCache*> caches; // of every thread that used the pool, for trim
+    };
+
+    struct LocalCache {
+        std::vector<void*> free;
+        int64_t liveDelta = 0;
+        uint64_t generation = 0;
+
+        LocalCache()
+        {
+            Global& g = global();
+            std::lock_guard<std::mutex> lock(g.mutex);
+            generation = g.generation.load(std::memory_order_relaxed);
+            g.caches.push_back(this);
+        }
+
+        ~LocalCache()
+        {
+            NodePool<T>::publish(*this);
+            NodePool<T>::flush(*this, free.size());
+            Global& g = global();
+            std::lock_guard<std::mutex> lock(g.mutex);
+            g.caches.erase(std::find(g.caches.begin(), g.caches.end(), this));
+        }
+    };
+
+    static Global& global()
+    {
+        // Never destroyed: the scheduler threads hand their cached slots back when they exit,
+        // which may be late in static destruction. The slabs go with the process.
+        static Global* g = new Global;
+        return *g;
+    }
+
+    static LocalCache& local()
+    {
+        Global& g = global();
+        thread_local LocalCache cache;
+        if (cache.generation != g.generation.load(std::memory_order_relaxed)) {
+            // The slabs behind these slots were trimmed.
+            cache.free.clear();
+            cache.generation = g.generation.load(std::memory_order_relaxed);
+        }
+        return cache;
+    }
+
+    static void publish(LocalCache& cache) noexcept
+    {
+        if (cache.liveDelta == 0) {
+            return;
+        }
+        Global& g = global();
+        int64_t live = g.live.fetch_add(cache.liveDelta, std::memory_order_relaxed) + cache.liveDelta;
+        cache.liveDelta = 0;
+        int64_t highWater = g.highWater.load(std::memory_order_relaxed);
+        while (live > highWater && !g.highWater.compare_exchange_weak(highWater, live, std::memory_order_relaxed)) {
+        }
+    }
+
+    static void refill(LocalCache& cache)
+    {
+        Global& g = global();
+        std::lock_guard<std::mutex> lock(g.mutex);
+        if (g.free.empty()) {
+            char* slab = static_cast<char*>(::operator new(slabSize * sizeof(T), std::align_val_t(alignof(T))));
+            g.slabs.push_back(slab);
+            for (size_t i = slabSize; i-- > 0;) {
+                g.free.push_back(slab + i * sizeof(T));
+            }
+        }
+        size_t n = std::min(batchSize, g.free.size());
+        cache.free.insert(cache.free.end(), g.free.end() - n, g.free.end());
+        g.free.resize(g.free.size() - n);
+    }
+
+    static void flush(LocalCache& cache, size_t n) noexcept
+    {
+        Global& g = global();
+        if (cache.generation != g.generation.load(std::memory_order_relaxed)) {
+            cache.free.clear();
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g.mutex);
+        g.free.insert(g.free.end(), cache.free.end() - n, cache.free.end());
+        cache.free.resize(cache.free.size() - n);
+    }
+};
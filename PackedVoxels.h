@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Vector3D.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A leaf as the lattice coordinates of its lowest voxel and the log2 of its edge length in voxels.
+template <class C>
+struct PackedLeaf {
+    C x;
+    C y;
+    C z;
+    uint8_t level;
+};
+
+// The leaves of a tree in Morton order, in a compact integer form. C is uint16_t when the
+// root edge fits in 16 bits, uint32_t otherwise. GL coordinates are computed on demand.
+template <class C>
+class PackedVoxels {
+public:
+    PackedVoxels() = default;
+    ~PackedVoxels() = default;
+
+    size_t size() const
+    {
+        return items.size();
+    }
+
+    const PackedLeaf<C>* data() const
+    {
+        return items.data();
+    }
+
+    const PackedLeaf<C>& operator[](const size_t i) const
+    {
+        return items[i];
+    }
+
+    uint32_t rootEdgeLength() const
+    {
+        return edge;
+    }
+
+    Vector3D<float> getCoordGL(const size_t i) const
+    {
+        const PackedLeaf<C>& leaf = items[i];
+        const float half = (float)(1u << leaf.level) * 0.5f;
+        const float scale = 2.0f / (float)edge;
+        return {
+            ((float)leaf.x + half) * scale - 1.0f,
+            ((float)leaf.y + half) * scale - 1.0f,
+            ((float)leaf.z + half) * scale - 1.0f
+        };
+    }
+
+    float edgeLengthGL(const size_t i) const
+    {
+        return (float)(1u << items[i].level) * 2.0f / (float)edge;
+    }
+
+    // Expands every leaf to the center and size layout of Topology::calculateVoxels.
+    void toGL(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes) const
+    {
+        coords.resize(items.size());
+        sizes.resize(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            coords[i] = getCoordGL(i);
+            sizes[i] = edgeLengthGL(i);
+        }
+    }
+
+    // Sizes the storage for count leaves and returns it for filling. Keeps the capacity of
+    // earlier calls, so a steady extraction does not allocate.
+    PackedLeaf<C>* resize(const uint32_t rootEdgeLength, const size_t count)
+    {
+        edge = rootEdgeLength;
+        items.resize(count);
+        return items.data();
+    }
+
+private:
+    std::vector<PackedLeaf<C>> items;
+    uint32_t edge = 1;
+};
@@ -0,0 +1,304 @@
+#pragma once
+
+#include "NodePool.h"
+#include "TopologyFile.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Counters of a paged store. A block touched while resident is a hit, one read back by a
+// finished prefetch is prefetched, and one read back while the cut waited is a miss.
+struct PagingStats {
+    uint64_t hits = 0;
+    uint64_t prefetched = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t readErrors = 0; // paged out blocks that could not be read back
+    uint64_t bytesWritten = 0;
+    uint64_t bytesRead = 0;
+    uint64_t residentBytes = 0;
+    uint64_t peakResidentBytes = 0;
+    double stallSeconds = 0.0; // spent waiting for misses
+
+    double hitRate() const
+    {
+        uint64_t touched = hits + prefetched + misses;
+        return touched > 0 ? (double)(hits + prefetched) / (double)touched : 1.0;
+    }
+};
+
+// A scratch file holding paged out nodes of one type, each in the record layout of a saved
+// tree: the node record, then the records of its subdivided children. A node keeps its slot
+// for as long as it lives, and is written back in place when it still fits. Prefetches are
+// read and decoded on a thread of their own and picked up later with take.
+template <class Node>
+class PageCache {
+public:
+    using Ptr = typename NodePool<Node>::Ptr;
+
+    static constexpr uint32_t noSlot = std::numeric_limits<uint32_t>::max();
+
+    PageCache() = default;
+
+    ~PageCache()
+    {
+        close();
+    }
+
+    PageCache(const PageCache&) = delete;
+    PageCache& operator=(const PageCache&) = delete;
+
+    // Creates the file, replacing anything there. Returns false when it cannot be written.
+    bool open(const std::string& path)
+    {
+        close();
+        file.open(path, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        filePath = path;
+        stopping = false;
+        reader = std::thread(&PageCache::run, this);
+        return true;
+    }
+
+    // Drops queued prefetches and removes the file.
+    void close()
+    {
+        if (!reader.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            jobs.clear();
+        }
+        wake.notify_one();
+        reader.join();
+        file.close();
+        std::filesystem::remove(filePath);
+        slots.clear();
+        wanted.clear();
+        ready.clear();
+        fileSize = 0;
+    }
+
+    bool isOpen() const
+    {
+        return reader.joinable();
+    }
+
+    // Writes node out to slot, or to a new slot when slot is noSlot, and returns the slot.
+    // Returns noSlot when it cannot be written.
+    uint32_t store(const Node& node, uint32_t slot, PagingStats& stats)
+    {
+        TopologyWriter out(2);
+        node.save(out, 0);
+        const uint64_t size = sizeof(PageHeader) + (out.level(0).size() + out.level(1).size()) * sizeof(uint64_t);
+        if (slot == noSlot) {
+            slot = (uint32_t)slots.size();
+            slots.push_back({});
+        }
+        Slot& s = slots[slot];
+        forget(slot);
+        if (size > s.capacity) {
+            s.offset = fileSize;
+            s.capacity = size;
+            fileSize += size;
+        }
+        s.size = size;
+        ++s.generation;
+        PageHeader header = { s.generation, out.count(1), out.level(0).size() };
+        {
+            std::lock_guard<std::mutex> lock(fileMutex);
+            file.seekp((std::streamoff)s.offset);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(out.level(0).data()), (std::streamsize)(out.level(0).size() * sizeof(uint64_t)));
+            file.write(reinterpret_cast<const char*>(out.level(1).data()), (std::streamsize)(out.level(1).size() * sizeof(uint64_t)));
+            if (!file) {
+                file.clear();
+                return noSlot;
+            }
+        }
+        stats.bytesWritten += size;
+        return slot;
+    }
+
+    // Reads the node in slot back, waiting for the file.
+    Ptr load(const uint32_t slot, PagingStats& stats)
+    {
+        forget(slot);
+        const Slot& s = slots[slot];
+        stats.bytesRead += s.size;
+        return read(s.offset, s.size, s.generation);
+    }
+
+    // Starts reading the node in slot back in the background, unless that is already under way.
+    void prefetch(const uint32_t slot)
+    {
+        const Slot& s = slots[slot];
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto [it, added] = wanted.try_emplace(slot, s.generation);
+            if (!added && it->second == s.generation) {
+                return;
+            }
+            it->second = s.generation;
+            ready.erase(slot);
+            jobs.push_back({ slot, s.offset, s.size, s.generation });
+        }
+        wake.notify_one();
+    }
+
+    // The node in slot when a prefetch of it finished, or nullptr.
+    Ptr take(const uint32_t slot, PagingStats& stats)
+    {
+        Ptr node;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (wanted.erase(slot) == 0) {
+                return nullptr;
+            }
+            auto it = ready.find(slot);
+            if (it == ready.end()) {
+                return nullptr;
+            }
+            node = std::move(it->second);
+            ready.erase(it);
+        }
+        stats.bytesRead += slots[slot].size;
+        return node;
+    }
+
+    // The node in slot is gone. Its space is not reused.
+    void release(const uint32_t slot)
+    {
+        forget(slot);
+        ++slots[slot].generation;
+    }
+
+    uint64_t bytesOnDisk() const
+    {
+        return fileSize;
+    }
+
+private:
+    struct PageHeader {
+        uint64_t generation;
+        uint64_t childRecords;
+        uint64_t nodeWords;
+    };
+
+    struct Slot {
+        uint64_t offset = 0;
+        uint64_t capacity = 0;
+        uint64_t size = 0;
+        uint64_t generation = 0; // bumped on every store, so a prefetch of an older version is dropped
+    };
+
+    struct Job {
+        uint32_t slot;
+        uint64_t offset;
+        uint64_t size;
+        uint64_t generation;
+    };
+
+    // The saved records of one node, as Node::load reads them.
+    struct Image {
+        const uint64_t* levels[2];
+        uint64_t recordWords[2];
+
+        const uint64_t* record(const uint32_t depth, const uint64_t index) const
+        {
+            return levels[depth] + index * recordWords[depth];
+        }
+    };
+
+    // Drops a prefetch of slot, finished or not.
+    void forget(const uint32_t slot)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wanted.erase(slot);
+        ready.erase(slot);
+    }
+
+    // Reads and decodes a node, or returns nullptr when the slot was written over since.
+    Ptr read(const uint64_t offset, const uint64_t size, const uint64_t generation)
+    {
+        std::vector<uint64_t> words((size - sizeof(PageHeader)) / sizeof(uint64_t));
+        PageHeader header;
+        {
+            std::lock_guard<std::mutex> lock(fileMutex);
+            file.seekg((std::streamoff)offset);
+            file.read(reinterpret_cast<char*>(&header), sizeof(header));
+            if (!file || header.generation != generation) {
+                file.clear();
+                return nullptr;
+            }
+            file.read(reinterpret_cast<char*>(words.data()), (std::streamsize)(words.size() * sizeof(uint64_t)));
+            if (!file) {
+                file.clear();
+                return nullptr;
+            }
+        }
+        Image image = { { words.data(), words.data() + header.nodeWords }, { header.nodeWords, 0 } };
+        if (header.childRecords > 0) {
+            image.recordWords[1] = (words.size() - header.nodeWords) / header.childRecords;
+        }
+        Ptr node = NodePool<Node>::make();
+        node->load(image, 0, 0);
+        return node;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            Job job = jobs.front();
+            jobs.pop_front();
+            auto stillWanted = [&] {
+                auto it = wanted.find(job.slot);
+                return it != wanted.end() && it->second == job.generation;
+            };
+            if (!stillWanted()) {
+                continue;
+            }
+            lock.unlock();
+            Ptr node = read(job.offset, job.size, job.generation);
+            lock.lock();
+            if (node != nullptr && stillWanted()) {
+                ready[job.slot] = std::move(node);
+            }
+        }
+    }
+
+    // Used by the owner only.
+    std::vector<Slot> slots;
+    uint64_t fileSize = 0;
+    std::string filePath;
+
+    std::fstream file;
+    std::mutex fileMutex;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    std::unordered_map<uint32_t, uint64_t> wanted; // slots with a prefetch under way or done, and its generation
+    std::unordered_map<uint32_t, Ptr> ready;
+    bool stopping = false;
+
+    std::thread reader;
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct SchedulerStats {
+    uint64_t tasks = 0; // tasks pushed by split loops
+    uint64_t steals = 0; // tasks run by another thread than the one that pushed them
+};
+
+// Runs the parallel loops of the tree on one pool of threads. Every thread owns a
+// queue of tasks: it pushes and pops its own work at the back and steals from the
+// front of the other queues once it runs dry. A loop is split in halves down to its
+// grain size, so a loop started inside a task adds tasks to the same pool instead of
+// opening a parallel region of its own. A thread waiting for a task it pushed runs
+// other tasks in the meantime. Threads that are not workers share the first queue.
+class Scheduler {
+public:
+    static Scheduler& instance()
+    {
+        static Scheduler scheduler;
+        return scheduler;
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    ~Scheduler()
+    {
+        stop();
+    }
+
+    // Runs loops on `count` threads, the calling thread included. 0 picks one thread per core.
+    // Must not be called while a loop is running.
+    void setThreadCount(uint32_t count)
+    {
+        if (count == 0) {
+            count = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (count == threadCount()) {
+            return;
+        }
+        stop();
+        start(count);
+    }
+
+    uint32_t threadCount() const
+    {
+        return (uint32_t)queues.size();
+    }
+
+    // Number of children of an internal node handled by one task.
+    void setGrainSize(uint32_t children)
+    {
+        grain.store(std::max(1u, children), std::memory_order_relaxed);
+    }
+
+    uint32_t grainSize() const
+    {
+        return grain.load(std::memory_order_relaxed);
+    }
+
+    SchedulerStats stats() const
+    {
+        return { taskCount.load(std::memory_order_relaxed), stealCount.load(std::memory_order_relaxed) };
+    }
+
+    void resetStats()
+    {
+        taskCount.store(0, std::memory_order_relaxed);
+        stealCount.store(0, std::memory_order_relaxed);
+    }
+
+    // Calls f(i) for every i in [begin, end) and returns once all calls are done.
+    template <class F>
+    void parallelFor(uint32_t begin, uint32_t end, uint32_t grain, const F& f)
+    {
+        if (threadCount() == 1) {
+            for (uint32_t i = begin; i < end; ++i) {
+                f(i);
+            }
+            return;
+        }
+        split(begin, end, std::max(1u, grain), f);
+    }
+
+    template <class F>
+    void parallelFor(uint32_t begin, uint32_t end, const F& f)
+    {
+        parallelFor(begin, end, grainSize(), f);
+    }
+
+private:
+    struct Task {
+        virtual ~Task() = default;
+        virtual void run() = 0;
+
+        // The owner may destroy the task as soon as done is set, so it is the last thing touched.
+        void execute()
+        {
+            run();
+            done.store(true, std::memory_order_release);
+        }
+
+        std::atomic<bool> done = false;
+    };
+
+    template <class F>
+    struct RangeTask : Task {
+        RangeTask(Scheduler& scheduler, uint32_t begin, uint32_t end, uint32_t grain, const F& f)
+            : scheduler(scheduler)
+            , begin(begin)
+            , end(end)
+            , grain(grain)
+            , f(f)
+        {
+        }
+
+        void run() override
+        {
+            scheduler.split(begin, end, grain, f);
+        }
+
+        Scheduler& scheduler;
+        uint32_t begin;
+        uint32_t end;
+        uint32_t grain;
+        const F& f;
+    };
+
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+    };
+
+    Scheduler()
+    {
+        start(std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    // Keeps the left half and offers the right half to the other threads, down to the grain size.
+    template <class F>
+    void split(uint32_t begin, uint32_t end, uint32_t grain, const F& f)
+    {
+        if (end - begin <= grain) {
+            for (uint32_t i = begin; i < end; ++i) {
+                f(i);
+            }
+            return;
+        }
+        uint32_t mid = begin + (end - begin) / 2;
+        RangeTask<F> right(*this, mid, end, grain, f);
+        push(right);
+        split(begin, mid, grain, f);
+        wait(right);
+    }
+
+    void push(Task& task)
+    {
+        uint32_t self = index();
+        {
+            std::lock_guard<std::mutex> lock(queues[self]->mutex);
+            queues[self]->tasks.push_back(&task);
+        }
+        taskCount.fetch_add(1, std::memory_order_relaxed);
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wake.notify_one();
+        }
+    }
+
+    void wait(Task& task)
+    {
+        uint32_t self = index();
+        while (!task.done.load(std::memory_order_acquire)) {
+            if (Task* t = find(self)) {
+                t->execute();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Pops the newest task of the own queue, or steals the oldest task of another one.
+    Task* find(uint32_t self)
+    {
+        {
+            Queue& q = *queues[self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                Task* t = q.tasks.back();
+                q.tasks.pop_back();
+                queued.fetch_sub(1);
+                return t;
+            }
+        }
+        for (uint32_t k = 1; k < queues.size(); ++k) {
+            Queue& q = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                Task* t = q.tasks.front();
+                q.tasks.pop_front();
+                queued.fetch_sub(1);
+                stealCount.fetch_add(1, std::memory_order_relaxed);
+                return t;
+            }
+        }
+        return nullptr;
+    }
+
+    void work(uint32_t self)
+    {
+        workerIndex() = self;
+        while (true) {
+            if (Task* t = find(self)) {
+                t->execute();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleepers.fetch_add(1);
+            wake.wait(lock, [&] { return stopping || queued.load() > 0; });
+            sleepers.fetch_sub(1);
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    void start(uint32_t count)
+    {
+        stopping = false;
+        queues.clear();
+        for (uint32_t i = 0; i < count; ++i) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (uint32_t i = 1; i < count; ++i) {
+            workers.emplace_back(&Scheduler::work, this, i);
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers) {
+            w.join();
+        }
+        workers.clear();
+    }
+
+    // Queue of the calling thread. Threads outside the pool use queue 0.
+    static uint32_t& workerIndex()
+    {
+        thread_local uint32_t i = 0;
+        return i;
+    }
+
+    uint32_t index() const
+    {
+        return workerIndex();
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int64_t> queued = 0;
+    std::atomic<uint32_t> sleepers = 0;
+    std::atomic<uint32_t> grain = 4;
+    std::atomic<uint64_t> taskCount = 0;
+    std::atomic<uint64_t> stealCount = 0;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "Tool.h"
+#include "Topology.h"
+#include "TripleBuffer.h"
+#include "Vector3D.h"
+#include "VoxelSegments.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The exposed leaves of the stock after `step` tool postures, in GL coordinates.
+struct VoxelSnapshot {
+    std::vector<Vector3D<float>> coords;
+    std::vector<float> sizes;
+    uint64_t step = 0;
+};
+
+struct SimulationStats {
+    uint64_t steps = 0; // postures removed since the last reset
+    uint64_t snapshots = 0; // snapshots published since the last reset
+    double stepsPerSecond = 0.0; // over the time spent running, snapshots included
+};
+
+// Steps the tool through its postures on a worker thread of its own and publishes
+// snapshots of the surface through a triple buffer, so a viewer draws the latest
+// complete snapshot at its own rate. A snapshot is only extracted once the previous
+// one was picked up, so the simulation is not held back by a slow reader. A posture is
+// cut in slices of a few milliseconds, so a heavy one does not hold back the next
+// snapshot either. Emptied or solid subtrees are pruned after each posture. A tree snapshot
+// is kept after each of the last postures, so that resetting and rewinding only restore a
+// snapshot instead of cutting again.
+class Simulation {
+public:
+    Simulation()
+        : pristine(topology.snapshot())
+        , worker(&Simulation::run, this)
+    {
+    }
+
+    explicit Simulation(float length, float width, float height, float toolRadius, float toolHeight)
+        : topology(length, width, height)
+        , tool(toolRadius, toolHeight)
+        , pristine(topology.snapshot())
+        , worker(&Simulation::run, this)
+    {
+    }
+
+    ~Simulation()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    Simulation(const Simulation&) = delete;
+    Simulation& operator=(const Simulation&) = delete;
+
+    void start()
+    {
+        command([&] { running = true; });
+    }
+
+    void pause()
+    {
+        command([&] { running = false; });
+    }
+
+    // Pauses, brings back the stock and the tool and publishes the initial snapshot.
+    void reset()
+    {
+        command([&] {
+            running = false;
+            resetting = true;
+        });
+    }
+
+    // Pauses and goes back by up to `steps` postures, as far as the kept snapshots reach.
+    void rewind(uint64_t steps)
+    {
+        command([&] {
+            running = false;
+            rewinding += steps;
+        });
+    }
+
+    bool isRunning() const
+    {
+        return running.load(std::memory_order_relaxed);
+    }
+
+    SimulationStats stats() const
+    {
+        uint64_t done = steps.load(std::memory_order_relaxed);
+        double seconds = (double)busyNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+        return { done, snapshotCount.load(std::memory_order_relaxed), seconds > 0 ? done / seconds : 0.0 };
+    }
+
+    // Reader side, for a single thread. Returns true when a newer snapshot became current.
+    bool update()
+    {
+        return snapshots.update();
+    }
+
+    const VoxelSnapshot& snapshot() const
+    {
+        return snapshots.front();
+    }
+
+private:
+    template <class F>
+    void command(const F& f)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            f();
+        }
+        wake.notify_one();
+    }
+
+    void run()
+    {
+        history.emplace_back(0, pristine);
+        publish();
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || resetting || rewinding > 0 || running; });
+                if (stopping) {
+                    return;
+                }
+                if (resetting) {
+                    resetting = false;
+                    rewinding = 0;
+                    lock.unlock();
+                    tool.reset();
+                    topology.restore(pristine);
+                    history.clear();
+                    history.emplace_back(0, pristine);
+                    steps.store(0, std::memory_order_relaxed);
+                    snapshotCount.store(0, std::memory_order_relaxed);
+                    busyNanoseconds.store(0, std::memory_order_relaxed);
+                    publish();
+                    continue;
+                }
+                if (rewinding > 0) {
+                    uint64_t back = std::exchange(rewinding, 0);
+                    lock.unlock();
+                    goBack(back);
+                    publish();
+                    continue;
+                }
+            }
+            auto stepStart = std::chrono::steady_clock::now();
+            bool moved = true;
+            if (topology.pendingBricks() == 0) {
+                moved = tool.moveToNextPosture();
+                if (moved) {
+                    topology.beginSubtract(tool);
+                }
+            }
+            if (moved) {
+                topology.resumeSubtract({ sliceTime });
+                if (topology.pendingBricks() == 0) {
+                    topology.prune();
+                    uint64_t done = steps.fetch_add(1, std::memory_order_relaxed) + 1;
+                    history.emplace_back(done, topology.snapshot());
+                    if (history.size() > historyLength) {
+                        history.pop_front();
+                    }
+                }
+            }
+            // The last state before going idle is always published, and before the
+            // simulation reports that it stopped.
+            if (!moved || !running || !snapshots.pending()) {
+                publish();
+            }
+            auto elapsed = std::chrono::steady_clock::now() - stepStart;
+            busyNanoseconds.fetch_add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), std::memory_order_relaxed);
+            if (!moved) {
+                running = false;
+            }
+        }
+    }
+
+    // Restores the latest kept snapshot at least `back` postures ago, or the oldest one, and
+    // moves the tool to the posture of that snapshot.
+    void goBack(uint64_t back)
+    {
+        uint64_t now = steps.load(std::memory_order_relaxed);
+        uint64_t target = now > back ? now - back : 0;
+        while (history.size() > 1 && history.back().first > target) {
+            history.pop_back();
+        }
+        const uint64_t step = history.back().first;
+        topology.restore(history.back().second);
+        tool.reset();
+        for (uint64_t i = 0; i < step; ++i) {
+            tool.moveToNextPosture();
+        }
+        steps.store(step, std::memory_order_relaxed);
+    }
+
+    // Only the bricks touched since the last snapshot are extracted again.
+    void publish()
+    {
+        topology.calculateVoxels(segments, Extraction::Surface);
+        VoxelSnapshot& snapshot = snapshots.back();
+        segments.gather(snapshot.coords, snapshot.sizes);
+        snapshot.step = steps.load(std::memory_order_relaxed);
+        snapshots.publish();
+        snapshotCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static constexpr std::chrono::milliseconds sliceTime { 4 };
+    static constexpr size_t historyLength = 1000;
+
+    // Owned by the worker.
+    Topology<> topology;
+    Tool tool;
+    VoxelSegments segments;
+    Topology<>::Snapshot pristine;
+    std::deque<std::pair<uint64_t, Topology<>::Snapshot>> history; // the step of each kept snapshot, the stock first
+
+    TripleBuffer<VoxelSnapshot> snapshots;
+    std::atomic<uint64_t> steps = 0;
+    std::atomic<uint64_t> snapshotCount = 0;
+    std::atomic<uint64_t> busyNanoseconds = 0;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> running = false;
+    bool resetting = false;
+    uint64_t rewinding = 0;
+    bool stopping = false;
+
+    std::thread worker; // last, so it starts once everything above is constructed
+};
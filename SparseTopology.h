@@ -0,0 +1,560 @@
+#pragma once
+
+#include "AABB3D.h"
+#include "Brick.h"
+#include "Capsule3D.h"
+#include "InternalNode.h"
+#include "NodePool.h"
+#include "PageCache.h"
+#include "Scheduler.h"
+#include "Tool.h"
+#include "Vector3D.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// The voxel size of a sparse stock: given in physical units, or chosen so that the longest
+// edge of the stock spans a number of voxels.
+struct VoxelResolution {
+    static VoxelResolution physical(const float voxelSize)
+    {
+        return { voxelSize, 0 };
+    }
+
+    static VoxelResolution fitToBox(const uint32_t voxelsAlongLongestEdge)
+    {
+        return { 0.0f, voxelsAlongLongestEdge };
+    }
+
+    float voxelSize;
+    uint32_t voxelsAlongLongestEdge;
+};
+
+// Where and beyond which size cut blocks of a sparse stock are paged out. An empty path keeps
+// everything in memory.
+struct PagingOptions {
+    std::string path;
+    uint64_t memoryBudget = 0;
+};
+
+// A stock on an unbounded voxel lattice anchored at the physical origin. In place of the
+// fixed root of Topology, the lattice is split into blocks of one internal node each, kept
+// in a hash map keyed by integer block coordinates, which may be negative. Only the blocks
+// overlapping the stock are stored, and a block the tool has not reached yet is stored as a
+// solid tile without a node, so memory follows the surface of the stock and the cut region
+// rather than a bounding cube. Each block works in a GL frame of its own, [-1, 1] over the
+// block, so long or far away stock keeps the precision of a small one.
+//
+// With paging enabled, cut blocks beyond a memory budget are written to a cache file and
+// read back when the tool reaches them again. Blocks under the postures passed to prefetch
+// are read back in the background and are not paged out before the tool passed them.
+template <uint32_t N2 = 3, uint32_t N3 = 4>
+class SparseTopology {
+public:
+    using Block = InternalNode<Brick<N3>, N2>;
+
+    struct BlockKey {
+        int32_t x;
+        int32_t y;
+        int32_t z;
+
+        bool operator==(const BlockKey&) const = default;
+    };
+
+    // The stock is the box between min and max, in the physical coordinates of the tool.
+    // With paging options, the stock is built within the memory budget too; isPaging tells
+    // whether the cache file could be created.
+    SparseTopology(const AABB3D<float>& stock, const VoxelResolution& resolution, const PagingOptions& paging = {})
+        : stock(stock)
+        , VoxelSize(resolution.voxelSize > 0 ? resolution.voxelSize : longestEdge(stock) / (float)std::max(resolution.voxelsAlongLongestEdge, 1u))
+    {
+        if (!paging.path.empty()) {
+            enablePaging(paging.path, paging.memoryBudget);
+        }
+        initialize();
+    }
+
+    // A stock centered on the origin, like that of Topology.
+    SparseTopology(float length, float width, float height, const VoxelResolution& resolution, const PagingOptions& paging = {})
+        : SparseTopology(AABB3D<float>(Vector3D<float>(0, 0, 0), length / 2.0f, width / 2.0f, height / 2.0f), resolution, paging)
+    {
+    }
+
+    // Rebuilds the stock: a voxel is active when its center lies in the stock box.
+    void initialize()
+    {
+        blocks.clear();
+        if (pager != nullptr) {
+            pager->open(pagePath);
+        }
+        stats = {};
+        step = 1; // the initial stock counts as used before the first step
+        const auto min = components(stock.getMin()), max = components(stock.getMax());
+        int64_t lo[3], hi[3];
+        for (uint32_t a = 0; a < 3; ++a) {
+            lo[a] = (int64_t)std::ceil(min[a] / VoxelSize - 0.5);
+            hi[a] = (int64_t)std::floor(max[a] / VoxelSize - 0.5);
+            if (lo[a] > hi[a]) {
+                return;
+            }
+        }
+        std::vector<std::pair<BlockKey, Block*>> partial;
+        for (int64_t x = floorDiv(lo[0]); x <= floorDiv(hi[0]); ++x) {
+            for (int64_t y = floorDiv(lo[1]); y <= floorDiv(hi[1]); ++y) {
+                for (int64_t z = floorDiv(lo[2]); z <= floorDiv(hi[2]); ++z) {
+                    const int64_t key[3] = { x, y, z };
+                    bool solid = true;
+                    for (uint32_t a = 0; a < 3; ++a) {
+                        solid = solid && key[a] * blockEdge >= lo[a] && (key[a] + 1) * blockEdge - 1 <= hi[a];
+                    }
+                    auto& state = blocks[{ (int32_t)x, (int32_t)y, (int32_t)z }];
+                    if (!solid) {
+                        state.node = NodePool<Block>::make();
+                        partial.emplace_back(BlockKey { (int32_t)x, (int32_t)y, (int32_t)z }, state.node.get());
+                    }
+                }
+            }
+        }
+        // With paging, the blocks are built an eighth of the budget at a time and paged out in between.
+        const size_t chunk = pager != nullptr ? std::max<size_t>(memoryBudget / 8 / (sizeof(Block) + Block::maxChildrenCount() * (sizeof(Brick<N3>) + Brick<N3>::wordCount() * sizeof(uint64_t))), 1) : partial.size();
+        for (size_t first = 0; first < partial.size(); first += chunk) {
+            const size_t last = std::min(first + chunk, partial.size());
+            Scheduler::instance().parallelFor((uint32_t)first, (uint32_t)last, 1, [&](uint32_t i) {
+                const BlockKey& key = partial[i].first;
+                partial[i].second->initialize(AABB3D<float>(toBlock(key, stock.getMin()), toBlock(key, stock.getMax())), halfBlockEdge);
+            });
+            for (size_t i = first; i < last; ++i) {
+                const auto& [key, node] = partial[i];
+                if (!node->isActive) {
+                    blocks.erase(key);
+                } else {
+                    account(blocks[key]);
+                }
+            }
+            evict(Vector3D<float>(0, 0, 0));
+        }
+    }
+
+    // Pages blocks out to a cache file at path once the cut blocks take more than budget bytes.
+    // Returns false when the file cannot be created, or when a block paged out to the previous
+    // file cannot be read back, which then stays in use.
+    bool enablePaging(const std::string& path, const uint64_t budget)
+    {
+        for (auto& [key, state] : blocks) {
+            if (state.paged && !fault(state)) {
+                return false;
+            }
+        }
+        pager = std::make_unique<PageCache<Block>>();
+        if (!pager->open(path)) {
+            pager.reset();
+            return false;
+        }
+        pagePath = path;
+        memoryBudget = budget;
+        for (auto& [key, state] : blocks) {
+            state.page = PageCache<Block>::noSlot;
+        }
+        evict(Vector3D<float>(0, 0, 0));
+        return true;
+    }
+
+    bool isPaging() const
+    {
+        return pager != nullptr;
+    }
+
+    // Starts reading back the paged out blocks the tool cuts into at the given postures, and
+    // keeps the blocks under them in memory until the next subtract.
+    void prefetch(std::span<const Capsule3D<float>> upcoming)
+    {
+        if (pager == nullptr) {
+            return;
+        }
+        for (const Capsule3D<float>& shape : upcoming) {
+            forEachBlockUnder(shape, [&](const BlockKey& key, BlockState& state) {
+                if (state.node == nullptr && !state.paged) {
+                    return;
+                }
+                if (toBlock(key, shape).classify(blockBox()) != Overlap::Partial) {
+                    return;
+                }
+                state.used = step + 1;
+                if (state.paged) {
+                    pager->prefetch(state.page);
+                }
+            });
+        }
+    }
+
+    // Removes the tool at its current posture from every block it reaches. Returns false when
+    // a paged out block it cuts into cannot be read back; that block is left uncut and paged out.
+    bool subtract(const Tool& tool, const SubtractMode mode = SubtractMode::Batch)
+    {
+        const Capsule3D<float> shape = tool.getShape();
+        ++step;
+        std::vector<std::pair<BlockKey, BlockState*>> work;
+        forEachBlockUnder(shape, [&](const BlockKey& key, BlockState& state) {
+            work.emplace_back(key, &state);
+        });
+
+        std::vector<Overlap> overlap(work.size());
+        Scheduler::instance().parallelFor(0, (uint32_t)work.size(), 1, [&](uint32_t i) {
+            overlap[i] = toBlock(work[i].first, shape).classify(blockBox());
+        });
+        bool complete = true;
+        if (pager != nullptr) {
+            for (size_t i = 0; i < work.size(); ++i) {
+                if (overlap[i] == Overlap::Partial && !fault(*work[i].second)) {
+                    overlap[i] = Overlap::Outside;
+                    complete = false;
+                }
+            }
+        }
+
+        std::vector<uint8_t> removed(work.size(), 0);
+        Scheduler::instance().parallelFor(0, (uint32_t)work.size(), 1, [&](uint32_t i) {
+            BlockState& state = *work[i].second;
+            switch (overlap[i]) {
+            case Overlap::Outside:
+                return;
+            case Overlap::Inside:
+                removed[i] = 1;
+                return;
+            case Overlap::Partial:
+                break;
+            }
+            if (state.node == nullptr) {
+                state.node = NodePool<Block>::make();
+            }
+            state.node->subtract(toBlock(work[i].first, shape), mode, halfBlockEdge);
+            removed[i] = !state.node->isActive;
+        });
+        for (size_t i = 0; i < work.size(); ++i) {
+            BlockState& state = *work[i].second;
+            if (removed[i]) {
+                stats.residentBytes -= state.bytes;
+                if (pager != nullptr && state.page != PageCache<Block>::noSlot) {
+                    pager->release(state.page);
+                }
+                blocks.erase(work[i].first);
+            } else if (overlap[i] == Overlap::Partial) {
+                state.used = std::max(state.used, step);
+                account(state);
+            }
+        }
+        evict(shape.getBase());
+        return complete;
+    }
+
+    // Releases removed bricks and re-encodes the ones left alone since the last call, in the
+    // blocks held in memory.
+    void compact()
+    {
+        for (auto& [key, state] : blocks) {
+            if (state.node != nullptr) {
+                state.node->compact();
+                account(state);
+            }
+        }
+    }
+
+    uint64_t countVoxels() const
+    {
+        uint64_t count = 0;
+        for (const auto& [key, state] : blocks) {
+            count += state.paged ? state.voxels : state.node != nullptr ? state.node->countVoxels() : Block::voxelCount();
+        }
+        return count;
+    }
+
+    // Emits the center and edge length of every active voxel and tile, in physical coordinates.
+    // Paged out blocks are read back for the call and stay paged out. Returns false when one
+    // cannot be read back, whose voxels are then missing.
+    bool calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes)
+    {
+        coords.clear();
+        sizes.clear();
+        bool complete = true;
+        std::vector<Vector3D<float>> blockCoords;
+        std::vector<float> blockSizes;
+        for (const auto& [key, state] : blocks) {
+            typename NodePool<Block>::Ptr loaded;
+            Block* node = state.node.get();
+            if (state.paged) {
+                ++stats.misses;
+                loaded = read(state);
+                if (loaded == nullptr) {
+                    complete = false;
+                    continue;
+                }
+                node = loaded.get();
+            }
+            if (node == nullptr) {
+                coords.push_back(fromBlock(key, Vector3D<float>(0, 0, 0)));
+                sizes.push_back(blockEdge * VoxelSize);
+                continue;
+            }
+            blockCoords.clear();
+            blockSizes.clear();
+            node->calculateVoxels(blockCoords, blockSizes, halfBlockEdge);
+            for (size_t i = 0; i < blockCoords.size(); ++i) {
+                coords.push_back(fromBlock(key, blockCoords[i]));
+                sizes.push_back(blockSizes[i] * halfBlockEdge * VoxelSize);
+            }
+        }
+        return complete;
+    }
+
+    float voxelSize() const
+    {
+        return VoxelSize;
+    }
+
+    // Blocks holding stock, and how many of them were cut into and hold a node.
+    size_t blockCount() const
+    {
+        return blocks.size();
+    }
+
+    size_t nodeBlockCount() const
+    {
+        return (size_t)std::count_if(blocks.begin(), blocks.end(), [](const auto& b) { return b.second.node != nullptr || b.second.paged; });
+    }
+
+    // Cut blocks currently in the cache file.
+    size_t pagedBlockCount() const
+    {
+        return (size_t)std::count_if(blocks.begin(), blocks.end(), [](const auto& b) { return b.second.paged; });
+    }
+
+    const PagingStats& pagingStats() const
+    {
+        return stats;
+    }
+
+private:
+    // A block is solid without a node, cut with one, or paged out to the cache file.
+    struct BlockState {
+        typename NodePool<Block>::Ptr node;
+        uint32_t page = PageCache<Block>::noSlot; // kept while in memory, so it is written back in place
+        bool paged = false;
+        uint64_t voxels = 0; // while paged out
+        uint64_t bytes = 0; // while in memory
+        uint64_t used = 0; // the last step that cut into it, or a later one it is prefetched for
+    };
+
+    struct BlockKeyHash {
+        size_t operator()(const BlockKey& key) const
+        {
+            uint64_t h = (uint32_t)key.x;
+            h = h * 0x9e3779b97f4a7c15ull ^ (uint32_t)key.y;
+            h = h * 0x9e3779b97f4a7c15ull ^ (uint32_t)key.z;
+            return (size_t)(h ^ (h >> 29));
+        }
+    };
+
+    static constexpr int64_t blockEdge = Block::edgeLength();
+    static constexpr uint32_t halfBlockEdge = Block::halfEdgeLength();
+
+    // The bytes a block in memory takes: its node and the bricks it allocated, with their voxels.
+    static uint64_t residentBytes(const Block& node)
+    {
+        BrickStorageStats storage;
+        node.collectStorage(storage);
+        return sizeof(Block) + storage.bytes;
+    }
+
+    static AABB3D<float> blockBox()
+    {
+        return AABB3D<float>(Vector3D<float>(-1, -1, -1), Vector3D<float>(1, 1, 1));
+    }
+
+    // Calls f on every stored block the bounding box of shape reaches. Whichever is smaller is
+    // walked: the blocks under the shape or the stored ones.
+    template <class F>
+    void forEachBlockUnder(const Capsule3D<float>& shape, const F& f)
+    {
+        const auto base = components(shape.getBase());
+        const auto top = components(shape.getBase() + shape.getAxis() * shape.getLength());
+        int64_t lo[3], hi[3];
+        uint64_t range = 1;
+        for (uint32_t a = 0; a < 3; ++a) {
+            lo[a] = floorDiv((int64_t)std::floor((std::min(base[a], top[a]) - shape.getRadius()) / VoxelSize));
+            hi[a] = floorDiv((int64_t)std::floor((std::max(base[a], top[a]) + shape.getRadius()) / VoxelSize));
+            range *= (uint64_t)(hi[a] - lo[a] + 1);
+        }
+        if (range <= blocks.size()) {
+            for (int64_t x = lo[0]; x <= hi[0]; ++x) {
+                for (int64_t y = lo[1]; y <= hi[1]; ++y) {
+                    for (int64_t z = lo[2]; z <= hi[2]; ++z) {
+                        auto it = blocks.find({ (int32_t)x, (int32_t)y, (int32_t)z });
+                        if (it != blocks.end()) {
+                            f(it->first, it->second);
+                        }
+                    }
+                }
+            }
+            return;
+        }
+        for (auto& [key, state] : blocks) {
+            if (key.x >= lo[0] && key.x <= hi[0] && key.y >= lo[1] && key.y <= hi[1] && key.z >= lo[2] && key.z <= hi[2]) {
+                f(key, state);
+            }
+        }
+    }
+
+    void account(BlockState& state)
+    {
+        stats.residentBytes -= state.bytes;
+        state.bytes = residentBytes(*state.node);
+        stats.residentBytes += state.bytes;
+        stats.peakResidentBytes = std::max(stats.peakResidentBytes, stats.residentBytes);
+    }
+
+    // Reads a paged out block back for good, from a finished prefetch when there is one.
+    // Returns false when it cannot be read, and the block stays paged out.
+    bool fault(BlockState& state)
+    {
+        if (!state.paged) {
+            if (state.node != nullptr) {
+                ++stats.hits;
+            }
+            return true;
+        }
+        typename NodePool<Block>::Ptr node = pager->take(state.page, stats);
+        if (node != nullptr) {
+            ++stats.prefetched;
+        } else {
+            ++stats.misses;
+            node = read(state);
+            if (node == nullptr) {
+                return false;
+            }
+        }
+        state.node = std::move(node);
+        state.paged = false;
+        account(state);
+        return true;
+    }
+
+    // Reads a paged out block back, timing the wait. Returns nullptr and counts a read error
+    // when the read comes up short or fails.
+    typename NodePool<Block>::Ptr read(const BlockState& state)
+    {
+        auto start = std::chrono::steady_clock::now();
+        typename NodePool<Block>::Ptr node = pager->load(state.page, stats);
+        stats.stallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (node == nullptr) {
+            ++stats.readErrors;
+        }
+        return node;
+    }
+
+    // Pages out the blocks farthest from the tool until the cut blocks fit in the budget again,
+    // with some slack so that this does not run on every step. Blocks cut at this step or
+    // prefetched for a later one stay.
+    void evict(const Vector3D<float>& tool)
+    {
+        if (pager == nullptr || stats.residentBytes <= memoryBudget) {
+            return;
+        }
+        std::vector<std::pair<double, BlockState*>> candidates;
+        const auto p = components(tool);
+        for (auto& [key, state] : blocks) {
+            if (state.node == nullptr || state.used >= step || !state.node->hasChildren) {
+                continue;
+            }
+            const auto center = components(fromBlock(key, Vector3D<float>(0, 0, 0)));
+            double d = 0;
+            for (uint32_t a = 0; a < 3; ++a) {
+                d += (center[a] - p[a]) * (center[a] - p[a]);
+            }
+            candidates.emplace_back(d, &state);
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        const uint64_t target = memoryBudget - memoryBudget / 8;
+        for (const auto& [d, state] : candidates) {
+            if (stats.residentBytes <= target) {
+                break;
+            }
+            uint32_t page = pager->store(*state->node, state->page, stats);
+            if (page == PageCache<Block>::noSlot) {
+                break;
+            }
+            state->page = page;
+            state->voxels = state->node->countVoxels();
+            state->node.reset();
+            state->paged = true;
+            stats.residentBytes -= state->bytes;
+            state->bytes = 0;
+            ++stats.evictions;
+        }
+    }
+
+    static float longestEdge(const AABB3D<float>& box)
+    {
+        Vector3D<float> size = box.getMax() - box.getMin();
+        return std::max(size.x, std::max(size.y, size.z));
+    }
+
+    static std::array<double, 3> components(const Vector3D<float>& v)
+    {
+        return { v.x, v.y, v.z };
+    }
+
+    // The block holding voxel coordinate v.
+    static int64_t floorDiv(const int64_t v)
+    {
+        return v >= 0 ? v / blockEdge : -((-v + blockEdge - 1) / blockEdge);
+    }
+
+    // Physical coordinates into the GL frame of a block, taken in double so far away blocks keep their precision.
+    Vector3D<float> toBlock(const BlockKey& key, const Vector3D<float>& p) const
+    {
+        const int64_t origin[3] = { key.x * blockEdge, key.y * blockEdge, key.z * blockEdge };
+        const auto physical = components(p);
+        double local[3];
+        for (uint32_t a = 0; a < 3; ++a) {
+            local[a] = (physical[a] / VoxelSize - (double)origin[a]) / halfBlockEdge - 1.0;
+        }
+        return Vector3D<float>((float)local[0], (float)local[1], (float)local[2]);
+    }
+
+    Capsule3D<float> toBlock(const BlockKey& key, const Capsule3D<float>& shape) const
+    {
+        const float scale = 1.0f / (VoxelSize * halfBlockEdge);
+        return Capsule3D<float>(toBlock(key, shape.getBase()), shape.getAxis(), shape.getRadius() * scale, shape.getLength() * scale);
+    }
+
+    Vector3D<float> fromBlock(const BlockKey& key, const Vector3D<float>& gl) const
+    {
+        const int64_t origin[3] = { key.x * blockEdge, key.y * blockEdge, key.z * blockEdge };
+        const auto local = components(gl);
+        double p[3];
+        for (uint32_t a = 0; a < 3; ++a) {
+            p[a] = ((double)origin[a] + (local[a] + 1.0) * halfBlockEdge) * VoxelSize;
+        }
+        return Vector3D<float>((float)p[0], (float)p[1], (float)p[2]);
+    }
+
+    const AABB3D<float> stock;
+    const float VoxelSize;
+    std::unordered_map<BlockKey, BlockState, BlockKeyHash> blocks;
+
+    std::unique_ptr<PageCache<Block>> pager; // nullptr: everything stays in memory
+    std::string pagePath;
+    uint64_t memoryBudget = 0;
+    uint64_t step = 0;
+    PagingStats stats;
+};
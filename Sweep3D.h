@@ -0,0 +1,183 @@
+#pragma once
+
+#include "AABB3D.h"
+#include "Capsule3D.h"
+#include "Vector3D.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// The volume a Capsule3D covers while it moves from one posture to another.
+// A pure translation is swept exactly. A change of direction is split into
+// translations with a fixed direction, each grown by how far the tool can
+// rotate away from that direction during the step. There are enough steps to
+// keep that margin below maxDeviation, so the sweep is conservative and never
+// removes more than maxDeviation beyond the true swept volume.
+template <class T>
+class Sweep3D {
+public:
+    Sweep3D() = default;
+    ~Sweep3D() = default;
+
+    Sweep3D(const Capsule3D<T>& from, const Capsule3D<T>& to, const T maxDeviation)
+    {
+        Vector3D<T> a0 = from.getAxis();
+        Vector3D<T> a1 = to.getAxis();
+        Vector3D<T> rotationAxis = a0.cross(a1);
+        T angle = rotationAxis.isZero() ? (T)0 : a0.angleToLine(a1);
+        // Farthest distance of any point of the tool from the center of rotation.
+        T reach = std::sqrt(from.getLength() * from.getLength() + from.getRadius() * from.getRadius());
+        uint32_t count = 1;
+        if (angle > 0 && maxDeviation > 0) {
+            count = std::max<uint32_t>(1, (uint32_t)std::ceil(angle * reach / maxDeviation));
+        }
+        T margin = angle / (T)count * reach;
+
+        steps.reserve(count);
+        Vector3D<T> move = (to.getBase() - from.getBase()) / (T)count;
+        for (uint32_t i = 0; i < count; ++i) {
+            Vector3D<T> axis = i == 0 || angle == 0 ? a0 : a0.rotate(rotationAxis, angle * (T)i / (T)count);
+            Capsule3D<T> start(from.getBase() + move * (T)i, axis, from.getRadius() + margin, from.getLength() + margin);
+            steps.push_back(Step { start, move, bounds(start, move) });
+        }
+    }
+
+    inline bool isInside(const Vector3D<T>& p) const noexcept
+    {
+        for (const auto& step : steps) {
+            if (step.bounds.isInside(p) && isInside(step, p)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline Overlap classify(const AABB3D<T>& box) const noexcept
+    {
+        Overlap result = Overlap::Outside;
+        for (const auto& step : steps) {
+            switch (classify(step, box)) {
+            case Overlap::Inside:
+                return Overlap::Inside;
+            case Overlap::Partial:
+                result = Overlap::Partial;
+                break;
+            case Overlap::Outside:
+                break;
+            }
+        }
+        return result;
+    }
+
+    inline Sweep3D<T> transformed(const T scale, const Vector3D<T>& offset) const noexcept
+    {
+        Sweep3D<T> s;
+        s.steps.reserve(steps.size());
+        for (const auto& step : steps) {
+            Capsule3D<T> start = step.start.transformed(scale, offset);
+            s.steps.push_back(Step { start, step.move * scale, bounds(start, step.move * scale) });
+        }
+        return s;
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, const Sweep3D<T>& s) noexcept
+    {
+        os << "Sweep3D: " << s.steps.size() << " steps";
+        for (const auto& step : s.steps) {
+            os << "\n  " << step.start << " move: " << step.move;
+        }
+        return os;
+    }
+
+private:
+    struct Step {
+        Capsule3D<T> start;
+        Vector3D<T> move;
+        AABB3D<T> bounds;
+    };
+
+    std::vector<Step> steps;
+
+    // p is swept by the step when the capsule, moved back along the path from p, hits it.
+    static constexpr inline bool isInside(const Step& step, const Vector3D<T>& p) noexcept
+    {
+        if (step.move.isZero()) {
+            return step.start.isInside(p);
+        }
+        T t0, t1;
+        return step.start.intersectLine(p, -step.move, t0, t1) && t0 <= 1 && t1 >= 0;
+    }
+
+    // A translated convex shape sweeps a convex volume, so eight corners inside mean the
+    // whole box is inside. A box is outside when one of a few candidate directions separates
+    // it from the volume, judged from the support functions of both.
+    static inline Overlap classify(const Step& step, const AABB3D<T>& box) noexcept
+    {
+        if (!step.bounds.intersects(box)) {
+            return Overlap::Outside;
+        }
+        Overlap atStart = step.start.classify(box);
+        if (step.move.isZero() || atStart == Overlap::Inside) {
+            return atStart;
+        }
+        Capsule3D<T> end = step.start.transformed((T)1, step.move);
+        if (end.classify(box) == Overlap::Inside) {
+            return Overlap::Inside;
+        }
+
+        Vector3D<T> axis = step.start.getAxis();
+        Vector3D<T> normal = axis.cross(step.move);
+        Vector3D<T> middle = step.start.getBase() + axis * (step.start.getLength() / 2) + step.move / 2;
+        Vector3D<T> candidates[] = {
+            Vector3D<T>(1, 0, 0), Vector3D<T>(0, 1, 0), Vector3D<T>(0, 0, 1),
+            axis, step.move, normal, box.getCenter() - middle
+        };
+        for (const auto& u : candidates) {
+            if (u.isZero()) {
+                continue;
+            }
+            if (isSeparating(step, box, u) || isSeparating(step, box, -u)) {
+                return Overlap::Outside;
+            }
+        }
+
+        Vector3D<T> min = box.getMin();
+        Vector3D<T> max = box.getMax();
+        for (uint32_t i = 0; i < 8; ++i) {
+            Vector3D<T> corner((i & 4) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 1) ? max.z : min.z);
+            if (!isInside(step, corner)) {
+                return Overlap::Partial;
+            }
+        }
+        return Overlap::Inside;
+    }
+
+    static inline AABB3D<T> bounds(const Capsule3D<T>& start, const Vector3D<T>& move) noexcept
+    {
+        Vector3D<T> top = start.getBase() + start.getAxis() * start.getLength();
+        Vector3D<T> min(std::min(start.getBase().x, top.x), std::min(start.getBase().y, top.y), std::min(start.getBase().z, top.z));
+        Vector3D<T> max(std::max(start.getBase().x, top.x), std::max(start.getBase().y, top.y), std::max(start.getBase().z, top.z));
+        Vector3D<T> end = min + move;
+        min = Vector3D<T>(std::min(min.x, end.x), std::min(min.y, end.y), std::min(min.z, end.z));
+        end = max + move;
+        max = Vector3D<T>(std::max(max.x, end.x), std::max(max.y, end.y), std::max(max.z, end.z));
+        return AABB3D<T>(min - start.getRadius(), max + start.getRadius());
+    }
+
+    // True when the whole swept volume lies below the whole box along u.
+    static constexpr inline bool isSeparating(const Step& step, const AABB3D<T>& box, const Vector3D<T>& u) noexcept
+    {
+        const Capsule3D<T>& c = step.start;
+        Vector3D<T> top = c.getBase() + c.getAxis() * c.getLength();
+        Vector3D<T> across = u - c.getAxis() * u.dot(c.getAxis());
+        // Support of the ball at the base and of the flat disc at the far end.
+        T sweptMax = std::max(u.dot(c.getBase()) + c.getRadius() * u.length(), u.dot(top) + c.getRadius() * across.length())
+            + std::max((T)0, u.dot(step.move));
+        T boxMin = u.dot(box.getCenter())
+            - box.getHalfSize(0) * std::abs(u.x) - box.getHalfSize(1) * std::abs(u.y) - box.getHalfSize(2) * std::abs(u.z);
+        return sweptMax < boxMin;
+    }
+};
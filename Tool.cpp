@@ -1,7 +1,12 @@
 #include "Tool.h"
 
+#include <algorithm>
 #include <numbers>
 
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 template <typename T>
 constexpr inline T radianToDegree(T radian) noexcept
 {
@@ -23,6 +28,11 @@ OBB3D<float> Tool::getBBox() const
     return OBB3D<float>(c, axisX, axisY, axisZ);
 }
 
+Capsule3D<float> Tool::getShape() const
+{
+    return Capsule3D<float>(currentPosture.center, currentPosture.direction, radius, height - radius);
+}
+
 bool Tool::isInside(const Vector3D<float>& p) const
 {
     Vector3D<float> d = p - currentPosture.center;
@@ -36,8 +46,79 @@ bool Tool::isInside(const Vector3D<float>& p) const
     return false;
 }
 
+uint64_t Tool::isInside(const Capsule3D<float>& shape, const float* x, const float* y, const float* z)
+{
+    const Vector3D<float> base = shape.getBase();
+    const Vector3D<float> axis = shape.getAxis();
+    const float length = shape.getLength();
+    const float radius2 = shape.getRadius() * shape.getRadius();
+    uint64_t mask = 0;
+
+#if defined(__AVX512F__)
+    const __m512 bx = _mm512_set1_ps(base.x), by = _mm512_set1_ps(base.y), bz = _mm512_set1_ps(base.z);
+    const __m512 ax = _mm512_set1_ps(axis.x), ay = _mm512_set1_ps(axis.y), az = _mm512_set1_ps(axis.z);
+    const __m512 len = _mm512_set1_ps(length), r2 = _mm512_set1_ps(radius2), zero = _mm512_setzero_ps();
+    for (uint32_t i = 0; i < 64; i += 16) {
+        __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + i), bx);
+        __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + i), by);
+        __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(z + i), bz);
+        __m512 t = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ax), _mm512_mul_ps(dy, ay)), _mm512_mul_ps(dz, az));
+        __mmask16 below = _mm512_cmp_ps_mask(t, len, _CMP_LE_OQ);
+        t = _mm512_max_ps(t, zero);
+        dx = _mm512_sub_ps(dx, _mm512_mul_ps(ax, t));
+        dy = _mm512_sub_ps(dy, _mm512_mul_ps(ay, t));
+        dz = _mm512_sub_ps(dz, _mm512_mul_ps(az, t));
+        __m512 d2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+        __mmask16 inside = _mm512_mask_cmp_ps_mask(below, d2, r2, _CMP_LE_OQ);
+        mask |= (uint64_t)inside << i;
+    }
+#elif defined(__AVX2__)
+    const __m256 bx = _mm256_set1_ps(base.x), by = _mm256_set1_ps(base.y), bz = _mm256_set1_ps(base.z);
+    const __m256 ax = _mm256_set1_ps(axis.x), ay = _mm256_set1_ps(axis.y), az = _mm256_set1_ps(axis.z);
+    const __m256 len = _mm256_set1_ps(length), r2 = _mm256_set1_ps(radius2), zero = _mm256_setzero_ps();
+    for (uint32_t i = 0; i < 64; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), bx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), by);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), bz);
+        __m256 t = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ax), _mm256_mul_ps(dy, ay)), _mm256_mul_ps(dz, az));
+        __m256 below = _mm256_cmp_ps(t, len, _CMP_LE_OQ);
+        t = _mm256_max_ps(t, zero);
+        dx = _mm256_sub_ps(dx, _mm256_mul_ps(ax, t));
+        dy = _mm256_sub_ps(dy, _mm256_mul_ps(ay, t));
+        dz = _mm256_sub_ps(dz, _mm256_mul_ps(az, t));
+        __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+        __m256 inside = _mm256_and_ps(below, _mm256_cmp_ps(d2, r2, _CMP_LE_OQ));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_ps(inside) << i;
+    }
+#else
+    for (uint32_t i = 0; i < 64; ++i) {
+        float dx = x[i] - base.x, dy = y[i] - base.y, dz = z[i] - base.z;
+        float t = dx * axis.x + dy * axis.y + dz * axis.z;
+        bool below = t <= length;
+        t = std::max(t, 0.0f);
+        dx -= axis.x * t;
+        dy -= axis.y * t;
+        dz -= axis.z * t;
+        mask |= (uint64_t)(below && dx * dx + dy * dy + dz * dz <= radius2) << i;
+    }
+#endif
+
+    return mask;
+}
+
+uint64_t Tool::isInside(const Sweep3D<float>& shape, const float* x, const float* y, const float* z)
+{
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < 64; ++i) {
+        mask |= (uint64_t)shape.isInside(Vector3D<float>(x[i], y[i], z[i])) << i;
+    }
+    return mask;
+}
+
 void Tool::reset()
 {
+    lastMoveRapid = false;
+    rapidPending = false;
     currentPostureIndex = 0;
     currentPostureListIndex = 0;
     currentPosture = postureList[0][0];
@@ -67,14 +148,18 @@ void Tool::loadPosture()
     currentPosture = postureList[0][0];
 }
 
-bool Tool::moveToNextPosture()
+bool Tool::moveToNextPosture(float centerStep, float directionStep)
 {
-    constexpr float centerStep = 5.0f;
-    constexpr float directionStep = degreeToRadian(0.5f);
-
     if (isEndPosture()) {
         return false;
     }
+    lastMoveRapid = false;
+    if (rapidPending) {
+        rapidPending = false;
+        lastMoveRapid = true;
+        currentPosture = postureList[currentPostureListIndex][currentPostureIndex];
+        return true;
+    }
 
     posture nextPosture = postureList[currentPostureListIndex][currentPostureIndex];
     float distance = nextPosture.center.distanceToPoint(currentPosture.center);
@@ -97,6 +182,21 @@ bool Tool::moveToNextPosture()
     return true;
 }
 
+std::vector<Capsule3D<float>> Tool::upcomingShapes(size_t count, float centerStep, float directionStep) const
+{
+    std::vector<Capsule3D<float>> shapes;
+    Tool ahead(*this);
+    while (shapes.size() < count && ahead.moveToNextPosture(centerStep, directionStep)) {
+        shapes.push_back(ahead.getShape());
+    }
+    return shapes;
+}
+
+bool Tool::isLastMoveRapid() const
+{
+    return lastMoveRapid;
+}
+
 constexpr inline bool Tool::isEndPosture() const
 {
     return currentPostureListIndex >= postureList.size();
@@ -118,10 +218,8 @@ void Tool::goToNextPosture()
     currentPostureIndex++;
     if (currentPostureIndex >= postureList[currentPostureListIndex].size()) {
         currentPostureListIndex++;
-        if (isEndPosture()) {
-            return;
-        }
         currentPostureIndex = 0;
-        currentPosture = postureList[currentPostureListIndex][currentPostureIndex];
+        // Stay on the last posture of the list for this move; the next one jumps to the following list.
+        rapidPending = !isEndPosture();
     }
 }
@@ -1,8 +1,12 @@
 #pragma once
 
+#include "Capsule3D.h"
 #include "OBB3D.h"
+#include "Sweep3D.h"
 #include "Vector3D.h"
 
+#include <cstdint>
+#include <numbers>
 #include <vector>
 
 class Tool {
@@ -20,11 +24,24 @@ public:
     }
 
     OBB3D<float> getBBox() const;
+    Capsule3D<float> getShape() const;
     bool isInside(const Vector3D<float>& p) const;
 
+    // Tests a block of 64 points given as separate x, y and z arrays against the shape
+    // and returns a mask with bit j set when point j is inside.
+    static uint64_t isInside(const Capsule3D<float>& shape, const float* x, const float* y, const float* z);
+    static uint64_t isInside(const Sweep3D<float>& shape, const float* x, const float* y, const float* z);
+
     void reset();
     void loadPosture();
-    bool moveToNextPosture();
+    bool moveToNextPosture(float centerStep = defaultCenterStep, float directionStep = defaultDirectionStep);
+    // The shapes of the next count moves, fewer near the end of the path, without moving the tool.
+    std::vector<Capsule3D<float>> upcomingShapes(size_t count, float centerStep = defaultCenterStep, float directionStep = defaultDirectionStep) const;
+    // True when the last move jumped to the start of the next posture list instead of cutting towards it.
+    bool isLastMoveRapid() const;
+
+    static constexpr float defaultCenterStep = 5.0f;
+    static constexpr float defaultDirectionStep = 0.5f / 180.0f * std::numbers::pi_v<float>;
 
 private:
     const float radius = 50.0f;
@@ -38,6 +55,8 @@ private:
     std::vector<std::vector<posture>> postureList;
     size_t currentPostureIndex = 0;
     size_t currentPostureListIndex = 0;
+    bool lastMoveRapid = false;
+    bool rapidPending = false;
 
     constexpr inline bool isEndPosture() const;
     inline void moveToNextCenter(const Vector3D<float>& nextCenter, float centerStep);
@@ -3,74 +3,795 @@
 #include "AABB3D.h"
 #include "BBox3D.h"
 #include "Brick.h"
+#include "Capsule3D.h"
 #include "InternalNode.h"
+#include "Journal.h"
+#include "Mesh.h"
 #include "Morton.h"
+#include "NodePool.h"
 #include "OBB3D.h"
+#include "PackedVoxels.h"
 #include "RootNode.h"
+#include "Scheduler.h"
+#include "Sweep3D.h"
+#include "Tool.h"
+#include "TopologyFile.h"
 #include "Vector3D.h"
+#include "VoxelSegments.h"
 
 #include <algorithm>
+#include <array>
 #include <chrono>
-#include <fstream>
+#include <cstdint>
 #include <functional>
-#include <iostream>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+// Limits one call of Topology::resumeSubtract. Work stops at the first brick past either
+// limit, and at least one brick is cut per call.
+struct SubtractBudget {
+    std::chrono::nanoseconds time = std::chrono::nanoseconds::max();
+    uint64_t bricks = std::numeric_limits<uint64_t>::max();
+};
+
+struct SubtractProgress {
+    uint64_t bricksDone = 0; // by this call
+    uint64_t bricksRemaining = 0; // over all pending postures
+
+    bool done() const
+    {
+        return bricksRemaining == 0;
+    }
+};
+
+// What one step took from the stock, kept by Topology::startMetrics.
+struct StepMetrics {
+    uint64_t removedVoxels = 0;
+    uint32_t engagedVoxels = 0; // voxels left with a face on one the step removed, where the tool touched the stock
+    uint32_t bricks = 0; // brick-sized cells that lost voxels, cut into or removed whole
+};
+
 template <uint32_t N1 = 2, uint32_t N2 = 3, uint32_t N3 = 4>
 class Topology {
 public:
+    // Lattice coordinate type of the packed extraction: 16 bits whenever the root edge fits.
+    using PackedCoord = std::conditional_t<(N1 + N2 + N3 <= 16), uint16_t, uint32_t>;
+
     Topology() = default;
-    ~Topology()
-    {
-        fout.close();
-    }
+    ~Topology() = default;
     explicit Topology(float _length)
-        : Length(_length)
+        : MaxEdge(_length)
+        , Length(_length)
         , Width(_length)
         , Height(_length)
-        , MaxEdge(_length)
     {
         initialize();
     }
 
     explicit Topology(float _length, float _width, float _height)
-        : Length(_length)
+        : MaxEdge(std::max(_length, std::max(_width, _height)))
+        , Length(_length)
         , Width(_width)
         , Height(_height)
-        , MaxEdge(std::max(_length, std::max(_width, _height)))
     {
         initialize();
     }
 
+    // Rebuilds the stock. The nodes released by the reset go back to the pools and are reused by the new tree.
     void initialize()
     {
         AABB3D<float> bbox(Vector3D<float>(0, 0, 0), Length / 2.0f, Width / 2.0f, Height / 2.0f);
         AABB3D<float> bboxGL(coordToGL(bbox.getMin()), coordToGL(bbox.getMax()));
         root.initialize(bboxGL, root.halfEdgeLength());
+        dropPendingCuts();
+    }
+
+    class Snapshot;
+
+    // A version of the tree that later changes leave alone. Only the root is copied; the nodes
+    // below stay shared until a change reaches them, and then only the changed nodes and the
+    // path to them are copied. So a snapshot costs memory in proportion to what changed since.
+    Snapshot snapshot() const
+    {
+        return Snapshot(root);
+    }
+
+    // Goes back, or forward, to a snapshot. Whatever differs from the current tree is marked
+    // dirty, so the incremental extractions only re-emit that. Drops any queued subtraction.
+    void restore(const Snapshot& snapshot)
+    {
+        dropPendingCuts();
+        Root before = root;
+        root = snapshot.root;
+        root.markChanged(before);
     }
 
-    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes)
+    // Writes the tree in the format described in TopologyFile.h. Returns false when the file cannot be written.
+    bool save(const std::string& path) const
+    {
+        return save(path, root);
+    }
+
+    // Writes a snapshot instead, which may be done on another thread while this tree is changed.
+    bool save(const std::string& path, const Snapshot& snapshot) const
+    {
+        return save(path, snapshot.root);
+    }
+
+    // Replaces the tree by a saved one, so that cutting can go on from there. Returns false
+    // when the file is not open or was saved from a stock of other dimensions.
+    bool load(const MappedTopology<N1, N2, N3>& file)
+    {
+        if (!file.isOpen() || file.length() != Length || file.width() != Width || file.height() != Height) {
+            return false;
+        }
+        dropPendingCuts();
+        root.reset();
+        if (file.isRootSubdivided()) {
+            root.load(file, 0, 0);
+        }
+        root.isActive = file.isRootActive();
+        return true;
+    }
+
+    bool load(const std::string& path)
+    {
+        MappedTopology<N1, N2, N3> file;
+        return file.open(path) && load(file);
+    }
+
+    // Streams the changes of every later step to journal, a step being one call of subtract or
+    // subtractSweep, or a resumable subtraction once resumeSubtract has cut all queued bricks.
+    // A step is found by comparing the tree with a snapshot of the previous one, so only the
+    // changed bricks, as the XOR of their changed words, and the replaced nodes are visited and
+    // written. The tree is saved as checkpoint 0, and again every checkpointInterval steps when
+    // that is not 0; checkpoints are saved from a snapshot by the writer thread. Returns false
+    // when the journal cannot be created.
+    bool startJournal(JournalWriter& journal, const std::string& path, const uint64_t checkpointInterval = 0)
+    {
+        JournalFileHeader header = {};
+        header.n[0] = N1;
+        header.n[1] = N2;
+        header.n[2] = N3;
+        header.length = Length;
+        header.width = Width;
+        header.height = Height;
+        if (!journal.open(path, header)) {
+            return false;
+        }
+        this->journal = &journal;
+        journalInterval = checkpointInterval;
+        journalStep = 0;
+        journalBase = snapshot();
+        checkpoint();
+        return true;
+    }
+
+    // Stops recording; the journal itself is closed by its owner.
+    void stopJournal()
+    {
+        journal = nullptr;
+        journalBase.reset();
+    }
+
+    // The last step recorded to the journal.
+    uint64_t journalSteps() const
+    {
+        return journalStep;
+    }
+
+    // Keeps the StepMetrics of every later step, a step as for the journal, from an empty series.
+    // The removed voxels are read from the counts. The rest comes from what the bricks cut into
+    // and the nodes removed whole report as they go, looked up against the tree once per step.
+    void startMetrics()
+    {
+        stepMetrics.clear();
+        metering = true;
+    }
+
+    void stopMetrics()
+    {
+        metering = false;
+    }
+
+    const std::vector<StepMetrics>& metrics() const
+    {
+        return stepMetrics;
+    }
+
+    // Applies the records of one journal step. Returns false when they do not fit the tree,
+    // which is then left partly changed. Drops any queued subtraction.
+    bool applyDelta(const std::span<const std::byte> records)
+    {
+        dropPendingCuts();
+        DeltaReader reader(records);
+        DeltaRecord record;
+        while (reader.next(record)) {
+            if (record.level != Root::sumN()) {
+                if (!root.isActive || !root.applyDelta(record)) {
+                    return false;
+                }
+                continue;
+            }
+            if (record.id != 0) {
+                return false;
+            }
+            switch (record.op) {
+            case DeltaOp::Deactivate:
+                root.isActive = false;
+                root.isDirty = true;
+                break;
+            case DeltaOp::Tile:
+                root.reset();
+                break;
+            case DeltaOp::Subdivide:
+                if (!root.isActive || root.hasChildren) {
+                    return false;
+                }
+                root.isDirty = true;
+                root.subdivide();
+                break;
+            case DeltaOp::Words:
+                return false;
+            }
+        }
+        return !reader.failed();
+    }
+
+    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes, const Extraction extraction = Extraction::All)
     {
         coords.clear();
         sizes.clear();
         coords.reserve(1 << (N1 + N2));
         sizes.reserve(1 << (N1 + N2));
+        if (extraction == Extraction::Surface) {
+            if (root.isActive) {
+                root.calculateSurfaceVoxels(coords, sizes, root.halfEdgeLength(), SurfaceLookup(root));
+            }
+            return;
+        }
         root.calculateVoxels(coords, sizes, root.halfEdgeLength());
     }
 
+    // Extracts every leaf into packed, in Morton order. One walk lists the tiles and bricks,
+    // their leaf counts are taken in parallel, a prefix sum gives each its offset and the
+    // leaves are then written in parallel straight into place.
+    void calculateVoxels(PackedVoxels<PackedCoord>& packed)
+    {
+        runs.clear();
+        if (root.isActive) {
+            root.collectLeaves(runs);
+        }
+        Scheduler& scheduler = Scheduler::instance();
+        scheduler.parallelFor(0, (uint32_t)runs.size(), runGrain, [&](uint32_t r) {
+            runs[r].count = runs[r].brick != nullptr ? runs[r].brick->countVoxels() : 1;
+        });
+        uint64_t total = 0;
+        for (auto& run : runs) {
+            run.offset = total;
+            total += run.count;
+        }
+        PackedLeaf<PackedCoord>* leaves = packed.resize(root.edgeLength(), total);
+        scheduler.parallelFor(0, (uint32_t)runs.size(), runGrain, [&](uint32_t r) {
+            const LeafRun& run = runs[r];
+            PackedLeaf<PackedCoord>* out = leaves + run.offset;
+            if (run.brick == nullptr) {
+                Vector3D<uint32_t> v = Morton::decode(run.firstVoxel);
+                *out = { (PackedCoord)v.x, (PackedCoord)v.y, (PackedCoord)v.z, (uint8_t)run.level };
+                return;
+            }
+            run.brick->forEachVoxel([&](uint32_t x, uint32_t y, uint32_t z) {
+                *out++ = { (PackedCoord)x, (PackedCoord)y, (PackedCoord)z, 0 };
+            });
+        });
+    }
+
+    // Updates segments from the nodes changed since the last call. segments.changes() lists the
+    // segments that were added, rewritten or dropped. The dirty flags live in the tree, so a
+    // Topology feeds a single VoxelSegments, always with the same extraction; the first call
+    // after initialize() emits everything. For a surface extraction the neighbours of every
+    // changed leaf, diagonal ones included, are extracted again as well, since they may have
+    // become exposed.
+    void calculateVoxels(VoxelSegments& segments, const Extraction extraction = Extraction::All)
+    {
+        segments.beginUpdate();
+        if (!root.isActive) {
+            segments.removeAll();
+            return;
+        }
+        if (extraction == Extraction::All) {
+            root.calculateVoxels(segments, root.halfEdgeLength(), (const SurfaceLookup*)nullptr);
+            return;
+        }
+        std::vector<std::pair<Vector3D<uint32_t>, uint32_t>> boxes;
+        root.collectDirty(boxes);
+        const int64_t edge = root.edgeLength();
+        for (const auto& [origin, size] : boxes) {
+            // The box grown by one voxel, so diagonal neighbours are included for smooth meshing.
+            auto clip = [&](int64_t v) {
+                return (uint32_t)std::clamp<int64_t>(v, 0, edge);
+            };
+            root.markDirty(Vector3D<uint32_t>(clip((int64_t)origin.x - 1), clip((int64_t)origin.y - 1), clip((int64_t)origin.z - 1)),
+                Vector3D<uint32_t>(clip((int64_t)origin.x + size + 1), clip((int64_t)origin.y + size + 1), clip((int64_t)origin.z + size + 1)));
+        }
+        SurfaceLookup surface(root);
+        root.calculateVoxels(segments, root.halfEdgeLength(), &surface);
+    }
+
+    // Re-meshes, in parallel, the tiles and bricks whose surface changed since the last call,
+    // in the physical coordinates of the stock. cache.gather() then gives the whole mesh.
+    void calculateMesh(MeshCache& cache)
+    {
+        VoxelSegments& segments = cache.segments();
+        calculateVoxels(segments, Extraction::Surface);
+        const VoxelChanges& changes = segments.changes();
+        auto& meshes = cache.entries();
+        for (uint64_t key : changes.removed) {
+            meshes.erase(key);
+        }
+        std::vector<std::pair<uint64_t, Mesh*>> work;
+        for (const auto* keys : { &changes.added, &changes.changed }) {
+            for (uint64_t key : *keys) {
+                work.emplace_back(key, &meshes[key]);
+            }
+        }
+        SurfaceLookup lookup(root);
+        Scheduler::instance().parallelFor(0, (uint32_t)work.size(), 1, [&](uint32_t w) {
+            meshRegion(lookup, work[w].first, cache.style(), *work[w].second);
+        });
+    }
+
+    // Voxels left in the stock. Every node keeps the count of its subtree up to date as it is
+    // cut, so this reads the root instead of walking the tree.
+    uint64_t countVoxels() const
+    {
+        return root.activeVoxels().count;
+    }
+
+    // The box in physical coordinates that tightly holds the voxels left in the stock, or
+    // nothing once the stock is gone. Read from the root like countVoxels.
+    std::optional<AABB3D<float>> activeBounds() const
+    {
+        const ActiveVoxels active = root.activeVoxels();
+        if (active.count == 0) {
+            return std::nullopt;
+        }
+        auto toPhysical = [&](const Vector3D<uint32_t>& v) {
+            return Vector3D<float>((float)v.x, (float)v.y, (float)v.z) * voxelSize() - MaxEdge / 2.0f;
+        };
+        return AABB3D<float>(toPhysical(active.min), toPhysical(active.max));
+    }
+
+    // Releases removed nodes and lets the bricks left alone since the last call switch to their
+    // smallest encoding. Call it between steps; nodes a snapshot still holds are left alone.
+    void compact()
+    {
+        root.compact();
+    }
+
+    // Collapses the subtrees changed since the last extraction that ended up empty or solid into
+    // tiles. Call it between steps, before the incremental extraction. Nodes a snapshot holds
+    // are copied on the way, so with a journal the merges go into the next step.
+    void prune()
+    {
+        root.prune();
+    }
+
+    BrickStorageStats brickStorage() const
+    {
+        BrickStorageStats stats;
+        root.collectStorage(stats);
+        return stats;
+    }
+
+    struct PoolStats {
+        NodePoolStats internalNodes;
+        NodePoolStats bricks;
+    };
+
+    // The pools are shared by every Topology with the same shape.
+    static PoolStats poolStats()
+    {
+        return { NodePool<InternalNode<Brick<N3>, N2>>::stats(), NodePool<Brick<N3>>::stats() };
+    }
+
+    // Hands the pooled node memory back to the system once no Topology of this shape holds nodes anymore.
+    static void trimPools()
+    {
+        NodePool<InternalNode<Brick<N3>, N2>>::trim();
+        NodePool<Brick<N3>>::trim();
+    }
+
+    float voxelSize() const
+    {
+        return MaxEdge / (float)root.edgeLength();
+    }
+
     void subtract(const BBox3D<float>& bbox, const std::function<bool(const Vector3D<float>&)>& isInside)
     {
-        auto startTime = std::chrono::high_resolution_clock::now();
         auto bboxGL = OBB3D<float>(coordToGL(bbox.getCenter()), coordToGL(bbox.getAxis(0)), coordToGL(bbox.getAxis(1)), coordToGL(bbox.getAxis(2)));
         auto isInsideGL = [&](const Vector3D<float>& coord) {
             return isInside(this->coordFromGL(coord));
         };
-        root.subtract(bboxGL, isInsideGL, root.halfEdgeLength());
-        auto endTime = std::chrono::high_resolution_clock::now();
-        fout << "Subtract time: " << std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count() << " ms" << std::endl;
+        const uint64_t before = countVoxels();
+        root.subtract(bboxGL, isInsideGL, root.halfEdgeLength(), cutTally());
+        meter(before);
+        recordStep();
+    }
+
+    // Removes the tool at its current posture, either testing a whole brick word at a time or clipping voxel rows.
+    void subtract(const Tool& tool, const SubtractMode mode = SubtractMode::Batch)
+    {
+        auto shapeGL = tool.getShape().transformed(2.0f / MaxEdge, Vector3D<float>(0, 0, 0));
+        const uint64_t before = countVoxels();
+        if (root.isActive) {
+            root.subtract(shapeGL, mode, root.halfEdgeLength(), cutTally());
+        }
+        meter(before);
+        recordStep();
+    }
+
+    // Removes a run of tool postures in one traversal. Gives the same result as subtracting them one by one.
+    void subtract(std::span<const Capsule3D<float>> tools, const SubtractMode mode = SubtractMode::Batch)
+    {
+        std::vector<Capsule3D<float>> toolsGL;
+        toolsGL.reserve(tools.size());
+        for (const auto& tool : tools) {
+            toolsGL.push_back(tool.transformed(2.0f / MaxEdge, Vector3D<float>(0, 0, 0)));
+        }
+        const uint64_t before = countVoxels();
+        if (root.isActive && !toolsGL.empty()) {
+            root.subtract(std::span<const Capsule3D<float>>(toolsGL), mode, root.halfEdgeLength(), cutTally());
+        }
+        meter(before);
+        recordStep();
+    }
+
+    // Starts removing the tool at its current posture, to be finished by resumeSubtract. The
+    // nodes the tool covers go at once; the bricks it cuts into are queued. The tree stays
+    // valid in between, each brick being cut in one go, and further postures can be queued
+    // before the earlier ones are finished without changing the result.
+    void beginSubtract(const Tool& tool, const SubtractMode mode = SubtractMode::Batch)
+    {
+        auto shapeGL = tool.getShape().transformed(2.0f / MaxEdge, Vector3D<float>(0, 0, 0));
+        std::vector<uint64_t> bricks;
+        const uint64_t before = countVoxels();
+        if (root.isActive) {
+            root.collectBricks(shapeGL, root.halfEdgeLength(), bricks, cutTally());
+        }
+        meter(before);
+        if (bricks.empty()) {
+            // Nothing left for resumeSubtract, so the step ends here unless earlier postures are still queued.
+            if (pendingBricks() == 0) {
+                recordStep();
+            }
+            return;
+        }
+        uint32_t shape = (uint32_t)pendingShapes.size();
+        pendingShapes.push_back({ shapeGL, mode });
+        for (uint64_t firstVoxel : bricks) {
+            pendingCuts.push_back({ firstVoxel, shape });
+        }
+    }
+
+    // Cuts queued bricks until the budget runs out, one brick per thread and parallel loop,
+    // so a time budget is overrun by one brick at most.
+    SubtractProgress resumeSubtract(const SubtractBudget& budget = {})
+    {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t done = 0;
+        const uint64_t chunk = Scheduler::instance().threadCount();
+        struct BrickCut {
+            Brick<N3>* brick;
+            uint32_t shape;
+            uint64_t firstVoxel;
+            ActiveVoxels before;
+        };
+        std::vector<BrickCut> batch;
+        const uint64_t before = countVoxels();
+        while (nextCut < pendingCuts.size() && done < budget.bricks && (done == 0 || std::chrono::steady_clock::now() - start < budget.time)) {
+            uint64_t count = std::min({ chunk, (uint64_t)pendingCuts.size() - nextCut, budget.bricks - done });
+            batch.clear();
+            for (uint64_t k = nextCut; k < nextCut + count; ++k) {
+                const PendingShape& shape = pendingShapes[pendingCuts[k].shape];
+                // The tree may have changed since the cut was queued, so the brick is looked up again.
+                Brick<N3>* brick = root.isActive ? root.reachBrick(shape.tool, pendingCuts[k].firstVoxel, root.halfEdgeLength(), cutTally()) : nullptr;
+                if (brick == nullptr) {
+                    continue;
+                }
+                // Two postures cutting the same brick go to separate loops.
+                if (std::any_of(batch.begin(), batch.end(), [&](const BrickCut& b) { return b.brick == brick; })) {
+                    count = k - nextCut;
+                    break;
+                }
+                batch.push_back({ brick, pendingCuts[k].shape, pendingCuts[k].firstVoxel, brick->activeVoxels() });
+            }
+            Scheduler::instance().parallelFor(0, (uint32_t)batch.size(), 1, [&](uint32_t b) {
+                const PendingShape& shape = pendingShapes[batch[b].shape];
+                batch[b].brick->subtract(shape.tool, shape.mode, root.halfEdgeLength(), cutTally());
+            });
+            for (const BrickCut& cut : batch) {
+                root.recount(cut.firstVoxel, cut.before);
+            }
+            nextCut += count;
+            done += count;
+        }
+        meter(before);
+        if (nextCut == pendingCuts.size()) {
+            recordStep();
+            dropPendingCuts();
+        }
+        return { done, pendingBricks() };
     }
 
+    uint64_t pendingBricks() const
+    {
+        return pendingCuts.size() - nextCut;
+    }
+
+    // Removes everything the tool touches while moving from one posture to the other, in a single
+    // traversal. Changes of direction are followed to within a quarter of a voxel.
+    void subtractSweep(const Capsule3D<float>& from, const Capsule3D<float>& to, const SubtractMode mode = SubtractMode::Batch)
+    {
+        const float scale = 2.0f / MaxEdge;
+        const float quarterVoxelGL = 0.5f / (float)root.edgeLength();
+        Sweep3D<float> sweepGL(from.transformed(scale, Vector3D<float>(0, 0, 0)), to.transformed(scale, Vector3D<float>(0, 0, 0)), quarterVoxelGL);
+        const uint64_t before = countVoxels();
+        if (root.isActive) {
+            root.subtract(sweepGL, mode, root.halfEdgeLength(), cutTally());
+        }
+        meter(before);
+        recordStep();
+    }
+
+private:
+    using Root = RootNode<InternalNode<Brick<N3>, N2>, N1>;
+
+public:
+    class Snapshot {
+    public:
+        // Voxels of the stock in this version.
+        uint64_t countVoxels() const
+        {
+            return root.activeVoxels().count;
+        }
+
+    private:
+        friend class Topology;
+
+        explicit Snapshot(const Root& root)
+            : root(root)
+        {
+        }
+
+        Root root;
+    };
+
 private:
+
+    // A tile, or a brick with voxels of its own, and where its leaves go in the packed output.
+    struct LeafRun {
+        const Brick<N3>* brick;
+        uint64_t firstVoxel;
+        uint32_t level;
+        uint64_t count = 0;
+        uint64_t offset = 0;
+    };
+    static constexpr uint32_t runGrain = 64;
+
+    // A posture queued by beginSubtract, and one brick it still has to cut.
+    struct PendingShape {
+        Capsule3D<float> tool;
+        SubtractMode mode;
+    };
+    struct PendingCut {
+        uint64_t firstVoxel;
+        uint32_t shape;
+    };
+
+    // Answers the neighbour queries of a surface extraction, in voxel coordinates of the root.
+    // Everything outside the root is empty space.
+    class SurfaceLookup {
+    public:
+        explicit SurfaceLookup(const Root& root)
+            : root(root)
+        {
+        }
+
+        const Brick<N3>* brickAt(const int64_t x, const int64_t y, const int64_t z, bool& solid) const
+        {
+            if (!contains(x) || !contains(y) || !contains(z)) {
+                solid = false;
+                return nullptr;
+            }
+            return root.findBrick(Vector3D<uint32_t>((uint32_t)x, (uint32_t)y, (uint32_t)z), solid);
+        }
+
+        // True when some face neighbour of the cube [origin, origin + edge) is inactive.
+        bool isExposed(const Vector3D<uint32_t>& origin, const uint32_t edge) const
+        {
+            for (uint32_t f = 0; f < 6; ++f) {
+                int64_t min[3] = { origin.x, origin.y, origin.z };
+                int64_t max[3] = { min[0] + edge, min[1] + edge, min[2] + edge };
+                min[f / 2] = (f % 2) ? max[f / 2] : min[f / 2] - 1;
+                max[f / 2] = min[f / 2] + 1;
+                if (!contains(min[f / 2])) {
+                    return true;
+                }
+                if (!root.isSolid(Vector3D<uint32_t>(min[0], min[1], min[2]), Vector3D<uint32_t>(max[0], max[1], max[2]))) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        static constexpr bool contains(const int64_t v)
+        {
+            return v >= 0 && v < (int64_t)Root::edgeLength();
+        }
+
+        const Root& root;
+    };
+
+    // Meshes the tile or brick of a segment key block by block. Blocks deep inside a tile
+    // have no exposed faces and are skipped.
+    void meshRegion(const SurfaceLookup& lookup, const uint64_t key, const MeshStyle style, Mesh& mesh) const
+    {
+        constexpr uint32_t B = Brick<N3>::edgeLength();
+        const Vector3D<uint32_t> origin = Morton::decode(key >> 8);
+        const uint32_t blocks = (1u << (key & 0xff)) / B;
+        const float scale = voxelSize();
+        const Vector3D<float> offset(-MaxEdge / 2.0f, -MaxEdge / 2.0f, -MaxEdge / 2.0f);
+        std::array<uint8_t, BlockMesher<B>::gridSize> grid;
+        mesh.clear();
+        for (uint32_t bx = 0; bx < blocks; ++bx) {
+            for (uint32_t by = 0; by < blocks; ++by) {
+                for (uint32_t bz = 0; bz < blocks; ++bz) {
+                    auto inner = [&](uint32_t b) {
+                        return b > 0 && b + 1 < blocks;
+                    };
+                    if (inner(bx) && inner(by) && inner(bz)) {
+                        continue;
+                    }
+                    Vector3D<uint32_t> blockOrigin(origin.x + bx * B, origin.y + by * B, origin.z + bz * B);
+                    fillBlock(lookup, blockOrigin, grid);
+                    BlockMesher<B>::mesh(grid, blockOrigin, scale, offset, style, mesh);
+                }
+            }
+        }
+    }
+
+    // Occupancy of the brick-sized block at origin with a one voxel border. Each of the 27
+    // blocks around is looked up once, then read directly.
+    void fillBlock(const SurfaceLookup& lookup, const Vector3D<uint32_t>& origin, std::array<uint8_t, BlockMesher<Brick<N3>::edgeLength()>::gridSize>& grid) const
+    {
+        constexpr int32_t B = Brick<N3>::edgeLength();
+        const Brick<N3>* bricks[27];
+        bool solid[27];
+        for (uint32_t n = 0; n < 27; ++n) {
+            bricks[n] = lookup.brickAt((int64_t)origin.x + ((int64_t)(n / 9) - 1) * B, (int64_t)origin.y + ((int64_t)(n / 3 % 3) - 1) * B,
+                (int64_t)origin.z + ((int64_t)(n % 3) - 1) * B, solid[n]);
+        }
+        auto part = [](int32_t c) {
+            return c < 0 ? 0 : (c < B ? 1 : 2);
+        };
+        auto local = [](int32_t c) {
+            return (uint32_t)(c < 0 ? B - 1 : (c < B ? c : 0));
+        };
+        for (int32_t x = -1; x <= B; ++x) {
+            for (int32_t y = -1; y <= B; ++y) {
+                for (int32_t z = -1; z <= B; ++z) {
+                    uint32_t n = (part(x) * 3 + part(y)) * 3 + part(z);
+                    grid[BlockMesher<B>::gridIndex(x, y, z)] = bricks[n] != nullptr ? bricks[n]->isLocalActive(local(x), local(y), local(z)) : solid[n];
+                }
+            }
+        }
+    }
+
+    bool save(const std::string& path, const Root& tree) const
+    {
+        TopologyWriter out(MappedTopology<N1, N2, N3>::levelCount);
+        if (tree.isActive && tree.hasChildren) {
+            tree.save(out, 0);
+        }
+        TopologyFileHeader header = {};
+        header.n[0] = N1;
+        header.n[1] = N2;
+        header.n[2] = N3;
+        header.rootActive = tree.isActive;
+        header.rootSubdivided = tree.isActive && tree.hasChildren;
+        header.length = Length;
+        header.width = Width;
+        header.height = Height;
+        return out.write(path, header);
+    }
+
+    // Ends a step: adds its metrics to the series, writes the difference to the previous step to
+    // the journal, then makes the tree the base of the next one.
+    void recordStep()
+    {
+        if (metering) {
+            stepMetrics.push_back(measureStep());
+        }
+        if (journal == nullptr) {
+            return;
+        }
+        const Root& before = journalBase->root;
+        if (root.isActive != before.isActive || root.hasChildren != before.hasChildren) {
+            if (!root.isActive) {
+                journalDelta.deactivate(Root::sumN(), 0);
+            } else if (!before.isActive || !root.hasChildren) {
+                journalDelta.tile(Root::sumN(), 0);
+            }
+        }
+        if (root.isActive && root.hasChildren) {
+            root.writeDelta(before.isActive && before.hasChildren ? &before : nullptr, journalDelta);
+        }
+        journal->append(++journalStep, journalDelta.take());
+        journalBase = snapshot();
+        if (journalInterval != 0 && journalStep % journalInterval == 0) {
+            checkpoint();
+        }
+    }
+
+    void checkpoint()
+    {
+        journal->checkpoint(journalStep, [this, base = *journalBase](const std::string& path) {
+            return save(path, base);
+        });
+    }
+
+    // What the bricks of this step reported so far, while metering.
+    CutTally* cutTally()
+    {
+        return metering ? &tally : nullptr;
+    }
+
+    // Sums up what the cuts of the step reported, against the tree they left, and starts the next.
+    StepMetrics measureStep()
+    {
+        StepMetrics step;
+        step.removedVoxels = stepRemoved;
+        std::vector<Vector3D<uint32_t>> origins;
+        origins.reserve(tally.cuts.size());
+        for (const CutTally::Cut& cut : tally.cuts) {
+            origins.push_back(cut.origin);
+        }
+        std::sort(origins.begin(), origins.end(), [](const Vector3D<uint32_t>& a, const Vector3D<uint32_t>& b) {
+            return std::tie(a.x, a.y, a.z) < std::tie(b.x, b.y, b.z);
+        });
+        step.bricks = (uint32_t)(std::unique(origins.begin(), origins.end()) - origins.begin());
+        if (root.isActive) {
+            step.engagedVoxels = (uint32_t)Brick<N3>::countEngaged(tally.cuts, SurfaceLookup(root));
+        }
+        stepRemoved = 0;
+        tally.cuts.clear();
+        return step;
+    }
+
+    // Adds what one call removed to the step, from the count it started at.
+    void meter(const uint64_t before)
+    {
+        stepRemoved += before - countVoxels();
+    }
+
+    // A step left unfinished takes its metrics with it.
+    void dropPendingCuts()
+    {
+        pendingCuts.clear();
+        pendingShapes.clear();
+        nextCut = 0;
+        stepRemoved = 0;
+        tally.cuts.clear();
+    }
+
     constexpr inline Vector3D<float> coordToGL(const Vector3D<float>& coord)
     {
         return coord / (MaxEdge / 2.0f);
@@ -85,6 +806,18 @@ private:
     const float Length = 1000.0f;
     const float Width = 1000.0f;
     const float Height = 1000.0f;
-    RootNode<InternalNode<Brick<N3>, N2>, N1> root;
-    std::fstream fout = std::fstream("subtract_time.txt", std::ios::out);
+    Root root;
+    std::vector<LeafRun> runs; // reused by every packed extraction
+    std::vector<PendingShape> pendingShapes;
+    std::vector<PendingCut> pendingCuts;
+    size_t nextCut = 0;
+    JournalWriter* journal = nullptr;
+    uint64_t journalInterval = 0;
+    uint64_t journalStep = 0;
+    std::optional<Snapshot> journalBase; // the tree after the last recorded step
+    DeltaWriter journalDelta;
+    bool metering = false;
+    std::vector<StepMetrics> stepMetrics;
+    uint64_t stepRemoved = 0; // by the calls of the step under way
+    CutTally tally;
 };
@@ -0,0 +1,521 @@
+#pragma once
+
+#include "Morton.h"
+#include "Vector3D.h"
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A saved tree is a header followed by one section per tree level, root first, bricks last.
+// A section is an array of fixed-size records of 64-bit words, in the Morton order of the
+// nodes. The record of a node with children holds the index of its first subdivided child in
+// the next section, then a mask of its active children and a mask of its subdivided ones; an
+// active child that is not subdivided is a solid tile. The record of a brick is its words.
+// Sections start on 64-byte boundaries, so brick words can be used in place once mapped.
+// Files are written in the byte order of the machine and rejected on another one.
+struct TopologyFileHeader {
+    static constexpr char magicValue[4] = { 'V', 'D', 'B', 'T' };
+    static constexpr uint32_t currentVersion = 1;
+    static constexpr uint32_t byteOrderValue = 0x01020304;
+    static constexpr uint32_t maxLevels = 4;
+
+    struct Level {
+        uint64_t offset; // in bytes from the start of the file
+        uint64_t count; // records
+        uint32_t recordWords;
+        uint32_t reserved;
+    };
+
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint8_t n[maxLevels]; // log2 of the children per edge, root first
+    uint32_t levelCount;
+    uint32_t rootActive;
+    uint32_t rootSubdivided;
+    float length;
+    float width;
+    float height;
+    Level levels[maxLevels];
+};
+
+// Collects the records of a tree level by level while the tree is walked in Morton order.
+class TopologyWriter {
+public:
+    explicit TopologyWriter(const uint32_t levelCount)
+        : levels(levelCount)
+        , counts(levelCount, 0)
+        , recordWords(levelCount, 0)
+    {
+    }
+
+    static constexpr uint32_t maskWords(const uint32_t children)
+    {
+        return (children + 63) / 64;
+    }
+
+    uint64_t count(const uint32_t depth) const
+    {
+        return counts[depth];
+    }
+
+    // The records of level depth, back to back.
+    const std::vector<uint64_t>& level(const uint32_t depth) const
+    {
+        return levels[depth];
+    }
+
+    // A zeroed record at the end of level depth. Valid until the next record of that level.
+    uint64_t* append(const uint32_t depth, const uint32_t words)
+    {
+        recordWords[depth] = words;
+        ++counts[depth];
+        levels[depth].resize(levels[depth].size() + words, 0);
+        return levels[depth].data() + levels[depth].size() - words;
+    }
+
+    // Fills in the level table of header and writes the file. Returns false when it cannot be written.
+    bool write(const std::string& path, TopologyFileHeader header) const
+    {
+        std::memcpy(header.magic, TopologyFileHeader::magicValue, sizeof(header.magic));
+        header.version = TopologyFileHeader::currentVersion;
+        header.byteOrder = TopologyFileHeader::byteOrderValue;
+        header.levelCount = (uint32_t)levels.size();
+        uint64_t offset = align(sizeof(TopologyFileHeader));
+        for (uint32_t d = 0; d < levels.size(); ++d) {
+            header.levels[d] = { offset, counts[d], recordWords[d], 0 };
+            offset = align(offset + levels[d].size() * sizeof(uint64_t));
+        }
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        const char zeros[alignment] = {};
+        uint64_t written = sizeof(header);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (uint32_t d = 0; d < levels.size(); ++d) {
+            out.write(zeros, (std::streamsize)(header.levels[d].offset - written));
+            out.write(reinterpret_cast<const char*>(levels[d].data()), (std::streamsize)(levels[d].size() * sizeof(uint64_t)));
+            written = header.levels[d].offset + levels[d].size() * sizeof(uint64_t);
+        }
+        return (bool)out;
+    }
+
+private:
+    static constexpr uint64_t alignment = 64;
+
+    static constexpr uint64_t align(const uint64_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    std::vector<std::vector<uint64_t>> levels;
+    std::vector<uint64_t> counts;
+    std::vector<uint32_t> recordWords;
+};
+
+// A read-only mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        if (this != &other) {
+            close();
+            std::swap(address, other.address);
+            std::swap(length, other.length);
+#if defined(_WIN32)
+            std::swap(file, other.file);
+            std::swap(mapping, other.mapping);
+#endif
+        }
+        return *this;
+    }
+
+    bool open(const std::string& path)
+    {
+        close();
+#if defined(_WIN32)
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr) {
+            close();
+            return false;
+        }
+        address = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (address == nullptr) {
+            close();
+            return false;
+        }
+        length = (size_t)size.QuadPart;
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        address = p;
+        length = (size_t)st.st_size;
+#endif
+        return true;
+    }
+
+    void close()
+    {
+#if defined(_WIN32)
+        if (address != nullptr) {
+            UnmapViewOfFile(address);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (address != nullptr) {
+            munmap(address, length);
+        }
+#endif
+        address = nullptr;
+        length = 0;
+    }
+
+    const std::byte* data() const
+    {
+        return static_cast<const std::byte*>(address);
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    void* address = nullptr;
+    size_t length = 0;
+#if defined(_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+// A tree saved by Topology::save, mapped read-only. Opening only checks the header and the
+// node records; brick words are read straight from the mapping, so even a large file opens
+// in a few milliseconds. Topology::load copies it into a tree that can be cut further.
+template <uint32_t N1 = 2, uint32_t N2 = 3, uint32_t N3 = 4>
+class MappedTopology {
+public:
+    static constexpr uint32_t levelCount = 3;
+    static constexpr uint32_t brickLevel = levelCount - 1;
+
+    MappedTopology() = default;
+    ~MappedTopology() = default;
+
+    // Returns false when the file cannot be mapped, is not a tree with this shape, or is truncated.
+    bool open(const std::string& path)
+    {
+        header = nullptr;
+        if (!file.open(path) || !validate()) {
+            file.close();
+            return false;
+        }
+        return true;
+    }
+
+    bool isOpen() const
+    {
+        return header != nullptr;
+    }
+
+    float length() const
+    {
+        return header->length;
+    }
+
+    float width() const
+    {
+        return header->width;
+    }
+
+    float height() const
+    {
+        return header->height;
+    }
+
+    static constexpr uint32_t rootEdgeLength()
+    {
+        return 1u << (N1 + N2 + N3);
+    }
+
+    bool isRootActive() const
+    {
+        return header->rootActive != 0;
+    }
+
+    bool isRootSubdivided() const
+    {
+        return header->rootSubdivided != 0;
+    }
+
+    uint64_t recordCount(const uint32_t depth) const
+    {
+        return header->levels[depth].count;
+    }
+
+    // The record of node index at depth, or the words of brick index at the brick level.
+    const uint64_t* record(const uint32_t depth, const uint64_t index) const
+    {
+        const TopologyFileHeader::Level& level = header->levels[depth];
+        return reinterpret_cast<const uint64_t*>(file.data() + level.offset) + index * level.recordWords;
+    }
+
+    uint64_t countVoxels() const
+    {
+        if (!isRootActive()) {
+            return 0;
+        }
+        return isRootSubdivided() ? countVoxels(0, 0) : childVoxels(0) << (3 * N1);
+    }
+
+    bool isVoxelActive(const Vector3D<uint32_t>& p) const
+    {
+        if (!isRootActive()) {
+            return false;
+        }
+        if (!isRootSubdivided()) {
+            return true;
+        }
+        const uint64_t voxel = Morton::encode(p.x, p.y, p.z);
+        uint64_t index = 0;
+        for (uint32_t depth = 0; depth < brickLevel; ++depth) {
+            const uint64_t* r = record(depth, index);
+            const uint32_t i = (uint32_t)(voxel >> (3 * childSumN(depth))) & (children(depth) - 1);
+            if (!testBit(r + 1, i)) {
+                return false;
+            }
+            if (!testBit(r + 1 + maskWords(depth), i)) {
+                return true;
+            }
+            index = r[0] + rank(r + 1 + maskWords(depth), i);
+        }
+        const uint32_t j = (uint32_t)voxel & ((1u << (3 * N3)) - 1);
+        return testBit(record(brickLevel, index), j);
+    }
+
+    // Same leaves in the same order as Topology::calculateVoxels with Extraction::All.
+    void calculateVoxels(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes) const
+    {
+        coords.clear();
+        sizes.clear();
+        if (!isRootActive()) {
+            return;
+        }
+        if (!isRootSubdivided()) {
+            emitTile(0, rootEdgeLength(), coords, sizes);
+            return;
+        }
+        calculateVoxels(0, 0, 0, coords, sizes);
+    }
+
+private:
+    static constexpr uint32_t levelN(const uint32_t depth)
+    {
+        return depth == 0 ? N1 : (depth == 1 ? N2 : N3);
+    }
+
+    static constexpr uint32_t children(const uint32_t depth)
+    {
+        return 1u << (3 * levelN(depth));
+    }
+
+    static constexpr uint32_t maskWords(const uint32_t depth)
+    {
+        return TopologyWriter::maskWords(children(depth));
+    }
+
+    static constexpr uint32_t recordWords(const uint32_t depth)
+    {
+        return depth == brickLevel ? maskWords(depth) : 1 + 2 * maskWords(depth);
+    }
+
+    // log2 of the edge length of a child of a node at depth.
+    static constexpr uint32_t childSumN(const uint32_t depth)
+    {
+        uint32_t sum = 0;
+        for (uint32_t d = depth + 1; d < levelCount; ++d) {
+            sum += levelN(d);
+        }
+        return sum;
+    }
+
+    static constexpr uint64_t childVoxels(const uint32_t depth)
+    {
+        return 1ull << (3 * childSumN(depth));
+    }
+
+    static bool testBit(const uint64_t* mask, const uint32_t i)
+    {
+        return (mask[i / 64] >> (i % 64)) & 1;
+    }
+
+    // Set bits of mask below bit i.
+    static uint64_t rank(const uint64_t* mask, const uint32_t i)
+    {
+        uint64_t count = 0;
+        for (uint32_t w = 0; w < i / 64; ++w) {
+            count += std::popcount(mask[w]);
+        }
+        if (i % 64 != 0) {
+            count += std::popcount(mask[i / 64] & ((1ull << (i % 64)) - 1));
+        }
+        return count;
+    }
+
+    bool validate()
+    {
+        if (file.size() < sizeof(TopologyFileHeader)) {
+            return false;
+        }
+        const auto* h = reinterpret_cast<const TopologyFileHeader*>(file.data());
+        if (std::memcmp(h->magic, TopologyFileHeader::magicValue, sizeof(h->magic)) != 0 || h->version != TopologyFileHeader::currentVersion
+            || h->byteOrder != TopologyFileHeader::byteOrderValue || h->levelCount != levelCount) {
+            return false;
+        }
+        for (uint32_t d = 0; d < levelCount; ++d) {
+            const TopologyFileHeader::Level& level = h->levels[d];
+            // A level without records, as below a root that is a single tile, carries no record size.
+            if (h->n[d] != levelN(d) || (level.count != 0 && level.recordWords != recordWords(d)) || level.offset % alignof(uint64_t) != 0
+                || level.offset > file.size() || level.count > (file.size() - level.offset) / (recordWords(d) * sizeof(uint64_t))) {
+                return false;
+            }
+        }
+        header = h;
+        if (isRootSubdivided() != (recordCount(0) == 1) || (!isRootActive() && isRootSubdivided())) {
+            header = nullptr;
+            return false;
+        }
+        // Every child index must stay inside the next section; bricks need no check.
+        for (uint32_t d = 0; d < brickLevel; ++d) {
+            for (uint64_t i = 0; i < recordCount(d); ++i) {
+                const uint64_t* r = record(d, i);
+                uint64_t subdivided = rank(r + 1 + maskWords(d), children(d));
+                if (r[0] > recordCount(d + 1) || subdivided > recordCount(d + 1) - r[0]) {
+                    header = nullptr;
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    uint64_t countVoxels(const uint32_t depth, const uint64_t index) const
+    {
+        const uint64_t* r = record(depth, index);
+        if (depth == brickLevel) {
+            uint64_t count = 0;
+            for (uint32_t w = 0; w < maskWords(depth); ++w) {
+                count += std::popcount(r[w]);
+            }
+            return count;
+        }
+        uint64_t count = 0, next = r[0];
+        for (uint32_t i = 0; i < children(depth); ++i) {
+            if (!testBit(r + 1, i)) {
+                continue;
+            }
+            count += testBit(r + 1 + maskWords(depth), i) ? countVoxels(depth + 1, next++) : childVoxels(depth);
+        }
+        return count;
+    }
+
+    void emitTile(const uint64_t firstVoxel, const uint32_t edge, std::vector<Vector3D<float>>& coords, std::vector<float>& sizes) const
+    {
+        const uint32_t half = rootEdgeLength() / 2;
+        Vector3D<uint32_t> center = Morton::decode(firstVoxel) + edge / 2;
+        coords.emplace_back((float)center.x / (float)half - 1.0f, (float)center.y / (float)half - 1.0f, (float)center.z / (float)half - 1.0f);
+        sizes.push_back((float)edge / (float)half);
+    }
+
+    void calculateVoxels(const uint32_t depth, const uint64_t index, const uint64_t firstVoxel, std::vector<Vector3D<float>>& coords, std::vector<float>& sizes) const
+    {
+        const uint64_t* r = record(depth, index);
+        const uint32_t half = rootEdgeLength() / 2;
+        if (depth == brickLevel) {
+            for (uint32_t w = 0; w < maskWords(depth); ++w) {
+                for (uint64_t bits = r[w]; bits != 0; bits &= bits - 1) {
+                    Vector3D<uint32_t> p = Morton::decode(firstVoxel + w * 64 + std::countr_zero(bits));
+                    coords.emplace_back(((float)p.x + 0.5f) / (float)half - 1.0f, ((float)p.y + 0.5f) / (float)half - 1.0f, ((float)p.z + 0.5f) / (float)half - 1.0f);
+                    sizes.push_back(1.0f / (float)half);
+                }
+            }
+            return;
+        }
+        uint64_t next = r[0];
+        for (uint32_t i = 0; i < children(depth); ++i) {
+            if (!testBit(r + 1, i)) {
+                continue;
+            }
+            const uint64_t childFirst = firstVoxel + ((uint64_t)i << (3 * childSumN(depth)));
+            if (testBit(r + 1 + maskWords(depth), i)) {
+                calculateVoxels(depth + 1, next++, childFirst, coords, sizes);
+            } else {
+                emitTile(childFirst, 1u << childSumN(depth), coords, sizes);
+            }
+        }
+    }
+
+    MappedFile file;
+    const TopologyFileHeader* header = nullptr;
+};
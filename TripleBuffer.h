@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// Hands values from one writer thread to one reader thread without locks. The writer
+// fills back() and publishes it; the reader picks up the latest published value with
+// update() and keeps reading front() until the next update. Neither side ever waits:
+// a value published before the reader got to it is replaced by the newer one.
+template <class T>
+class TripleBuffer {
+public:
+    TripleBuffer() = default;
+    ~TripleBuffer() = default;
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    // Writer side. The slot still holds an older value, to be overwritten.
+    T& back()
+    {
+        return slots[backIndex];
+    }
+
+    void publish()
+    {
+        backIndex = state.exchange(backIndex | fresh, std::memory_order_acq_rel) & indexMask;
+    }
+
+    // True while the last published value has not been picked up by the reader.
+    bool pending() const
+    {
+        return (state.load(std::memory_order_acquire) & fresh) != 0;
+    }
+
+    // Reader side. Returns false when nothing new was published since the last call.
+    bool update()
+    {
+        if ((state.load(std::memory_order_relaxed) & fresh) == 0) {
+            return false;
+        }
+        frontIndex = state.exchange(frontIndex, std::memory_order_acq_rel) & indexMask;
+        return true;
+    }
+
+    const T& front() const
+    {
+        return slots[frontIndex];
+    }
+
+private:
+    static constexpr uint8_t indexMask = 3;
+    static constexpr uint8_t fresh = 4;
+
+    std::array<T, 3> slots;
+    std::atomic<uint8_t> state = 1; // index of the middle slot, plus fresh once published
+    uint8_t backIndex = 0;
+    uint8_t frontIndex = 2;
+};
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Vector3D.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Leaves emitted by one brick or one solid tile, in GL coordinates.
+struct VoxelSegment {
+    std::vector<Vector3D<float>> coords;
+    std::vector<float> sizes;
+};
+
+// Keys of the segments an incremental extraction added, rewrote or dropped.
+struct VoxelChanges {
+    std::vector<uint64_t> added;
+    std::vector<uint64_t> changed;
+    std::vector<uint64_t> removed;
+
+    bool empty() const
+    {
+        return added.empty() && changed.empty() && removed.empty();
+    }
+
+    void clear()
+    {
+        added.clear();
+        changed.clear();
+        removed.clear();
+    }
+};
+
+// The extracted leaves of a tree, kept per brick or tile so that an update only
+// rewrites the segments below dirty nodes. A segment is keyed by the Morton index
+// of its first voxel and its level, so the segments of a subtree form one range.
+class VoxelSegments {
+public:
+    VoxelSegments() = default;
+    ~VoxelSegments() = default;
+
+    // level is the log2 of the edge length of the node in voxels.
+    static constexpr uint64_t key(const uint64_t firstVoxel, const uint32_t level)
+    {
+        return (firstVoxel << 8) | level;
+    }
+
+    const std::map<uint64_t, VoxelSegment>& segments() const
+    {
+        return items;
+    }
+
+    const VoxelChanges& changes() const
+    {
+        return diff;
+    }
+
+    size_t leafCount() const
+    {
+        size_t count = 0;
+        for (const auto& [key, segment] : items) {
+            count += segment.coords.size();
+        }
+        return count;
+    }
+
+    // Concatenates all segments in key order.
+    void gather(std::vector<Vector3D<float>>& coords, std::vector<float>& sizes) const
+    {
+        coords.clear();
+        sizes.clear();
+        coords.reserve(leafCount());
+        sizes.reserve(coords.capacity());
+        for (const auto& [key, segment] : items) {
+            coords.insert(coords.end(), segment.coords.begin(), segment.coords.end());
+            sizes.insert(sizes.end(), segment.sizes.begin(), segment.sizes.end());
+        }
+    }
+
+    void clear()
+    {
+        items.clear();
+        diff.clear();
+    }
+
+    // Starts a new update; the change list then only covers that update.
+    void beginUpdate()
+    {
+        diff.clear();
+    }
+
+    // Returns the emptied segment for key, recording it as added or changed.
+    VoxelSegment& write(const uint64_t key)
+    {
+        auto [it, inserted] = items.try_emplace(key);
+        (inserted ? diff.added : diff.changed).push_back(key);
+        it->second.coords.clear();
+        it->second.sizes.clear();
+        return it->second;
+    }
+
+    void remove(const uint64_t key)
+    {
+        if (items.erase(key) > 0) {
+            diff.removed.push_back(key);
+        }
+    }
+
+    // Drops every segment inside [firstVoxel, firstVoxel + voxelCount) except keep.
+    void removeRange(const uint64_t firstVoxel, const uint64_t voxelCount, const uint64_t keep = ~0ull)
+    {
+        auto it = items.lower_bound(key(firstVoxel, 0));
+        auto end = items.lower_bound(key(firstVoxel + voxelCount, 0));
+        while (it != end) {
+            if (it->first == keep) {
+                ++it;
+                continue;
+            }
+            diff.removed.push_back(it->first);
+            it = items.erase(it);
+        }
+    }
+
+    void removeAll()
+    {
+        for (const auto& [key, segment] : items) {
+            diff.removed.push_back(key);
+        }
+        items.clear();
+    }
+
+private:
+    std::map<uint64_t, VoxelSegment> items;
+    VoxelChanges diff;
+};
@@ -6,8 +6,8 @@
 
 GLWidget::GLWidget()
 {
-    timerUpdate = new QTimer(this);
-    timerCal = new QTimer(this);
+    timerFrame = new QTimer(this);
+    connect(timerFrame, &QTimer::timeout, this, QOverload<>::of(&GLWidget::pollSimulation));
 }
 
 GLWidget::~GLWidget()
@@ -16,30 +16,54 @@ GLWidget::~GLWidget()
     delete program;
     delete vshader;
     delete fshader;
-    delete timerUpdate;
-    delete timerCal;
+    delete timerFrame;
     vbo.destroy();
     vao.destroy();
     doneCurrent();
 }
 
-void GLWidget::updateTopology()
+// The simulation runs on its own thread; a frame is only drawn when it published a newer snapshot.
+void GLWidget::pollSimulation()
 {
-    if (!tool.moveToNextPosture()) {
-        timerUpdate->stop();
-        timerCal->stop();
-        return;
+    if (simulation.update()) {
+        snapshotChanged = true;
+        update();
     }
-    auto isInside = [&](const Vector3D<float>& p) {
-        return tool.isInside(p);
-    };
-    topology.subtract(tool.getBBox(), isInside);
+    reportStats();
 }
 
-void GLWidget::calTopology()
+void GLWidget::uploadSnapshot()
 {
-    topology.calculateVoxels(coords, sizes);
-    update();
+    const VoxelSnapshot& snapshot = simulation.snapshot();
+    leafCount = (unsigned int)snapshot.coords.size();
+    vbo.bind();
+    vbo.allocate(leafCount * 4 * sizeof(float));
+    vbo.write(0, snapshot.coords.data(), leafCount * 3 * sizeof(float));
+    vbo.write(leafCount * 3 * sizeof(float), snapshot.sizes.data(), leafCount * sizeof(float));
+    program->enableAttributeArray(0);
+    program->setAttributeBuffer(0, GL_FLOAT, 0, 3);
+    program->enableAttributeArray(1);
+    program->setAttributeBuffer(1, GL_FLOAT, leafCount * 3 * sizeof(float), 1);
+    snapshotChanged = false;
+}
+
+// Shows the step throughput of the simulation and the frame time of the viewer once per second.
+void GLWidget::reportStats()
+{
+    if (statsClock.elapsed() < 1000) {
+        return;
+    }
+    SimulationStats stats = simulation.stats();
+    double frameMs = frames > 0 ? (double)frameNanoseconds / frames * 1e-6 : 0.0;
+    double fps = frames * 1000.0 / statsClock.elapsed();
+    setWindowTitle(QString("vdb - step %1, %2 steps/s, %3 ms/frame, %4 fps")
+                       .arg(stats.steps)
+                       .arg(stats.stepsPerSecond, 0, 'f', 1)
+                       .arg(frameMs, 0, 'f', 2)
+                       .arg(fps, 0, 'f', 1));
+    frames = 0;
+    frameNanoseconds = 0;
+    statsClock.restart();
 }
 
 void GLWidget::initializeGL()
@@ -65,28 +89,24 @@ void GLWidget::initializeGL()
     program->setUniformValue("lightColor", lightColor);
     program->setUniformValue("lightPos", lightPos);
 
-    topology.calculateVoxels(coords, sizes);
-    auto leafCount = (unsigned int)coords.size();
-
     if (!vao.isCreated()) {
         vao.create();
     }
     vao.bind();
     if (!vbo.isCreated()) {
         vbo.create();
-        vbo.bind();
-        vbo.allocate(leafCount * 4 * sizeof(float));
     }
-
-    program->enableAttributeArray(0);
-    program->setAttributeBuffer(0, GL_FLOAT, 0, 3);
-    program->enableAttributeArray(1);
-    program->setAttributeBuffer(1, GL_FLOAT, leafCount * 3 * sizeof(float), 1);
+    // The initial snapshot is published by the simulation thread right after it starts.
+    snapshotChanged = true;
     vao.release();
+
+    statsClock.start();
+    timerFrame->start(16);
 }
 
 void GLWidget::paintGL()
 {
+    frameClock.start();
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -106,20 +126,18 @@ void GLWidget::paintGL()
     matProjection.perspective(camera.fov, qreal(width()) / qreal(height()), 0.1f, 100.f);
     program->setUniformValue(locProjection, matProjection);
 
-    auto leafCount = (unsigned int)coords.size();
-
     vao.bind();
-    vbo.allocate(leafCount * 4 * sizeof(float));
-    vbo.write(0, coords.data(), leafCount * 3 * sizeof(float));
-    vbo.write(leafCount * 3 * sizeof(float), sizes.data(), leafCount * sizeof(float));
-    program->enableAttributeArray(0);
-    program->setAttributeBuffer(0, GL_FLOAT, 0, 3);
-    program->enableAttributeArray(1);
-    program->setAttributeBuffer(1, GL_FLOAT, leafCount * 3 * sizeof(float), 1);
+    if (snapshotChanged) {
+        simulation.update();
+        uploadSnapshot();
+    }
     glDrawArrays(GL_POINTS, 0, leafCount);
     vao.release();
 
     program->disableAttributeArray(0);
+
+    ++frames;
+    frameNanoseconds += frameClock.nsecsElapsed();
 }
 
 void GLWidget::resizeGL(int w, int h)
@@ -133,21 +151,16 @@ void GLWidget::keyPressEvent(QKeyEvent* event)
     camera.keyPressEvent(event);
 
     if (event->key() == Qt::Key_Z) {
-        connect(timerUpdate, &QTimer::timeout, this, QOverload<>::of(&GLWidget::updateTopology));
-        timerUpdate->start(1);
-        connect(timerCal, &QTimer::timeout, this, QOverload<>::of(&GLWidget::calTopology));
-        timerCal->start(1);
+        simulation.start();
     }
     if (event->key() == Qt::Key_P) {
-        timerUpdate->stop();
-        timerCal->stop();
+        simulation.pause();
     }
     if (event->key() == Qt::Key_R) {
-        timerUpdate->stop();
-        timerCal->stop();
-        tool.reset();
-        topology.initialize();
-        topology.calculateVoxels(coords, sizes);
+        simulation.reset();
+    }
+    if (event->key() == Qt::Key_B) {
+        simulation.rewind(100);
     }
 
     update();
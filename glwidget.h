@@ -1,20 +1,18 @@
 #ifndef GLWIDGET_H
 #define GLWIDGET_H
 
-#include "Tool.h"
-#include "Topology.h"
-#include "Vector3D.h"
+#include "Simulation.h"
 #include "camera.h"
 
 #include <QOpenGLBuffer>
 #include <QOpenGLFunctions>
 #include <QOpenGLShaderProgram>
 #include <QOpenGLVertexArrayObject>
+#include <QElapsedTimer>
 #include <QOpenGLWidget>
 #include <QTimer>
 
 #include <cstdint>
-#include <vector>
 
 class GLWidget : public QOpenGLWidget, protected QOpenGLFunctions {
     Q_OBJECT
@@ -49,18 +47,22 @@ private:
     QMatrix4x4 matView;
     QMatrix4x4 matProjection;
 
-    QTimer* timerUpdate = nullptr;
-    QTimer* timerCal = nullptr;
+    QTimer* timerFrame = nullptr;
 
     Camera camera;
-    Topology<> topology;
-    Tool tool;
+    Simulation simulation;
 
-    std::vector<Vector3D<float>> coords;
-    std::vector<float> sizes;
+    unsigned int leafCount = 0;
+    bool snapshotChanged = false;
 
-    void updateTopology(void);
-    void calTopology(void);
+    QElapsedTimer statsClock;
+    QElapsedTimer frameClock;
+    uint64_t frames = 0;
+    qint64 frameNanoseconds = 0;
+
+    void pollSimulation(void);
+    void uploadSnapshot(void);
+    void reportStats(void);
 };
 
 #endif // GLWIDGET_H
@@ -0,0 +1,259 @@
+#include "Scheduler.h"
+#include "Tool.h"
+#include "Topology.h"
+#include "Vector3D.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+struct BenchConfig {
+    uint32_t steps = 100;
+    double minSeconds = 0.2;
+    std::vector<uint32_t> threads;
+    std::vector<Vector3D<float>> stocks = {
+        { 1000.0f, 1000.0f, 1000.0f },
+        { 960.0f, 960.0f, 960.0f },
+        { 1000.0f, 800.0f, 960.0f },
+    };
+    std::vector<float> radii = { 25.0f, 50.0f, 100.0f };
+    SubtractMode mode = SubtractMode::Batch;
+    uint32_t grain = Scheduler::instance().grainSize();
+};
+
+struct BenchResult {
+    const char* op;
+    uint64_t iterations;
+    double seconds;
+    uint64_t voxels;
+    uint64_t leaves;
+};
+
+// ns/op of the first thread count of each configuration, the baseline of the speedup columns.
+struct Baseline {
+    uint32_t threads;
+    double nsPerOp;
+};
+using Baselines = std::map<std::string, Baseline>;
+
+// Resets the kernel's peak RSS counter so that each configuration reports its own high-water mark.
+static void resetPeakRSS()
+{
+#if defined(__linux__)
+    std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+static uint64_t peakRSSKiB()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return pmc.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#elif defined(__linux__)
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            return std::strtoull(line.c_str() + 6, nullptr, 10);
+        }
+    }
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+template <class F>
+static double timeIt(F&& f)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    f();
+    auto endTime = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(endTime - startTime).count();
+}
+
+static void printHeader()
+{
+    std::cout << "shape,stock,radius,threads,op,iterations,ns_per_op,voxels_per_s,leaves,peak_rss_kib,speedup,efficiency\n";
+}
+
+// Speedup is relative to the same shape, stock, radius and op at the first thread count
+// run, efficiency is the speedup divided by the growth in threads.
+static void printResult(Baselines& baselines, const std::string& shape, const Vector3D<float>& stock, float radius, uint32_t threads, const BenchResult& r, uint64_t rss)
+{
+    double nsPerOp = r.iterations > 0 ? r.seconds * 1e9 / (double)r.iterations : 0.0;
+    double voxelsPerSecond = r.seconds > 0 ? (double)r.voxels / r.seconds : 0.0;
+    std::string key = shape + "," + std::to_string(stock.x) + "x" + std::to_string(stock.y) + "x" + std::to_string(stock.z)
+        + "," + std::to_string(radius) + "," + r.op;
+    const Baseline& baseline = baselines.try_emplace(key, Baseline { threads, nsPerOp }).first->second;
+    double speedup = nsPerOp > 0 ? baseline.nsPerOp / nsPerOp : 0.0;
+    double efficiency = speedup * (double)baseline.threads / (double)threads;
+    std::cout << shape << ","
+              << stock.x << "x" << stock.y << "x" << stock.z << ","
+              << radius << ","
+              << threads << ","
+              << r.op << ","
+              << r.iterations << ","
+              << (uint64_t)nsPerOp << ","
+              << (uint64_t)voxelsPerSecond << ","
+              << r.leaves << ","
+              << rss << ","
+              << speedup << ","
+              << efficiency << std::endl;
+}
+
+template <uint32_t N1, uint32_t N2, uint32_t N3>
+static void runShape(const BenchConfig& config)
+{
+    std::string shape = std::to_string(N1) + "/" + std::to_string(N2) + "/" + std::to_string(N3);
+    std::vector<Vector3D<float>> coords;
+    std::vector<float> sizes;
+    Baselines baselines;
+
+    for (uint32_t threads : config.threads) {
+        Scheduler::instance().setThreadCount(threads);
+        for (const auto& stock : config.stocks) {
+            for (float radius : config.radii) {
+                resetPeakRSS();
+                auto topology = std::make_unique<Topology<N1, N2, N3>>(stock.x, stock.y, stock.z);
+                Tool tool(radius, radius * 4.0f);
+
+                BenchResult init { "initialize", 0, 0.0, 0, 0 };
+                do {
+                    init.seconds += timeIt([&] { topology->initialize(); });
+                    ++init.iterations;
+                } while (init.seconds < config.minSeconds);
+                init.voxels = topology->countVoxels() * init.iterations;
+
+                BenchResult subtract { "subtract", 0, 0.0, 0, 0 };
+                uint64_t voxelsBefore = topology->countVoxels();
+                while (subtract.iterations < config.steps && tool.moveToNextPosture()) {
+                    subtract.seconds += timeIt([&] { topology->subtract(tool, config.mode); });
+                    ++subtract.iterations;
+                }
+                subtract.voxels = voxelsBefore - topology->countVoxels();
+
+                BenchResult calculate { "calculateVoxels", 0, 0.0, 0, 0 };
+                uint64_t voxelsAfter = topology->countVoxels();
+                do {
+                    calculate.seconds += timeIt([&] { topology->calculateVoxels(coords, sizes); });
+                    ++calculate.iterations;
+                } while (calculate.seconds < config.minSeconds);
+                calculate.voxels = voxelsAfter * calculate.iterations;
+                calculate.leaves = coords.size();
+
+                uint64_t rss = peakRSSKiB();
+                printResult(baselines, shape, stock, radius, threads, init, rss);
+                printResult(baselines, shape, stock, radius, threads, subtract, rss);
+                printResult(baselines, shape, stock, radius, threads, calculate, rss);
+            }
+        }
+    }
+}
+
+static void printUsage(const char* name)
+{
+    std::cout << "Usage: " << name << " [options]\n"
+              << "  --steps K        tool steps per subtract run (default 100)\n"
+              << "  --min-time S     minimum seconds per initialize/calculateVoxels run (default 0.2)\n"
+              << "  --threads a,b,c  thread counts to run (default 1,2,4,... up to all cores)\n"
+              << "  --grain G        internal node children per scheduler task (default 4)\n"
+              << "  --mode M         brick subtraction mode: batch or span (default batch)\n"
+              << "  --quick          one stock and one radius only\n"
+              << "  --help           show this message\n";
+}
+
+static std::vector<uint32_t> parseList(const char* s)
+{
+    std::vector<uint32_t> list;
+    while (*s) {
+        char* end = nullptr;
+        uint32_t v = (uint32_t)std::strtoul(s, &end, 10);
+        if (end == s) {
+            break;
+        }
+        if (v > 0) {
+            list.push_back(v);
+        }
+        s = *end == ',' ? end + 1 : end;
+    }
+    return list;
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            config.steps = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            config.minSeconds = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            config.threads = parseList(argv[++i]);
+        } else if (std::strcmp(argv[i], "--grain") == 0 && i + 1 < argc) {
+            config.grain = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "batch") == 0) {
+                config.mode = SubtractMode::Batch;
+            } else if (std::strcmp(argv[i], "span") == 0) {
+                config.mode = SubtractMode::Span;
+            } else {
+                std::cerr << "Unknown mode: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--quick") == 0) {
+            config.stocks.resize(1);
+            config.radii = { 50.0f };
+        } else if (std::strcmp(argv[i], "--help") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown or incomplete option: " << argv[i] << "\n";
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.threads.empty()) {
+        uint32_t maxThreads = std::max(1u, std::thread::hardware_concurrency());
+        for (uint32_t t = 1; t < maxThreads; t *= 2) {
+            config.threads.push_back(t);
+        }
+        config.threads.push_back(maxThreads);
+    }
+    Scheduler::instance().setGrainSize(config.grain);
+
+    printHeader();
+    runShape<2, 3, 4>(config);
+    runShape<3, 4, 3>(config);
+    runShape<2, 4, 5>(config);
+    return 0;
+}
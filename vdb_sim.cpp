@@ -0,0 +1,565 @@
+#include "Journal.h"
+#include "Mesh.h"
+#include "Scheduler.h"
+#include "Simulation.h"
+#include "SparseTopology.h"
+#include "Tool.h"
+#include "Topology.h"
+#include "Vector3D.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static void printUsage(const char* name)
+{
+    std::cout << "Usage: " << name << " [options]\n"
+              << "  --stock L W H    stock dimensions (default 1000 1000 1000)\n"
+              << "  --tool R H       tool radius and height (default 50 200)\n"
+              << "  --mode M         point: test every voxel through Tool::isInside\n"
+              << "                   batch: test whole brick words at once (default)\n"
+              << "                   span: clip voxel rows against the tool\n"
+              << "  --step S         tool step length (default 5)\n"
+              << "  --sweep          remove the swept volume between postures instead of\n"
+              << "                   the tool at each posture\n"
+              << "  --batch K        remove K consecutive postures per traversal (default 1)\n"
+              << "  --extract E      extract the leaves after every step: none (default),\n"
+              << "                   full, incremental or packed\n"
+              << "  --surface        extract only the leaves with an exposed face\n"
+              << "  --mesh S         re-mesh the touched bricks after every step: quads or smooth\n"
+              << "  --export PATH    write the final mesh as binary .stl or .ply\n"
+              << "  --load PATH      start from a tree saved with --save instead of the full stock\n"
+              << "  --save PATH      write the final tree\n"
+              << "  --prune          collapse emptied or solid subtrees into tiles after every step\n"
+              << "  --compact        re-encode the bricks left alone after every step\n"
+              << "  --snapshots      keep a tree snapshot after every step and rewind through them\n"
+              << "  --journal PATH   record the changes of every step to a journal\n"
+              << "  --checkpoint K   save a checkpoint with the journal every K steps (default 0:\n"
+              << "                   only the first one)\n"
+              << "  --metrics PATH   write the removed and engaged voxels and the bricks touched of every\n"
+              << "                   step to PATH as CSV\n"
+              << "  --replay PATH    scrub through a recorded journal instead of cutting\n"
+              << "  --sparse SIZE    keep the stock in blocks of a hash map, with voxels of SIZE\n"
+              << "  --fit N          like --sparse, with N voxels along the longest stock edge\n"
+              << "  --page-file PATH page cut blocks of --sparse or --fit out to PATH\n"
+              << "  --page-budget MB keep at most MB megabytes of cut blocks in memory (default 256)\n"
+              << "  --prefetch K     read back the blocks of the next K postures ahead (default 8)\n"
+              << "  --budget US      cut each posture in ticks of at most US microseconds\n"
+              << "  --viewer F       run the simulation on its own thread like the viewer does and\n"
+              << "                   pick up snapshots F times per second\n"
+              << "  --threads N      threads running the tree, 0 for one per core (default 0)\n"
+              << "  --grain G        internal node children per task (default 4)\n"
+              << "  --help           show this message\n";
+}
+
+// Seeks to the last step of a journal, then back to its middle and forward to the end again.
+static int runReplay(const std::string& path)
+{
+    JournalReader journal;
+    if (!journal.open(path)) {
+        std::cerr << "Cannot read " << path << "\n";
+        return 1;
+    }
+    const JournalFileHeader& header = journal.header();
+    Topology<> topology(header.length, header.width, header.height);
+    JournalReplayer<Topology<>> replayer(topology, journal);
+    for (uint64_t target : { journal.lastStep(), journal.lastStep() / 2, journal.lastStep() }) {
+        uint64_t applied = replayer.stepsApplied;
+        uint64_t loaded = replayer.checkpointsLoaded;
+        auto seekStart = std::chrono::steady_clock::now();
+        if (!replayer.seek(target)) {
+            std::cerr << "Cannot replay " << path << " to step " << target << "\n";
+            return 1;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - seekStart).count();
+        std::cout << "seek to step " << target << ": " << seconds * 1e3 << " ms, " << replayer.stepsApplied - applied << " steps applied, "
+                  << replayer.checkpointsLoaded - loaded << " checkpoints loaded, " << topology.countVoxels() << " voxels\n";
+    }
+    return 0;
+}
+
+// Cuts the tool path out of a stock kept in a hash map of blocks instead of a fixed root.
+// With a page file, cut blocks beyond the memory budget are paged out to it.
+static int runSparse(float length, float width, float height, const VoxelResolution& resolution, float toolRadius, float toolHeight, float step, SubtractMode mode,
+    const std::string& pagePath, uint64_t pageBudget, uint32_t prefetch, bool compacting)
+{
+    auto buildStart = std::chrono::steady_clock::now();
+    SparseTopology<> topology(length, width, height, resolution, { pagePath, pageBudget });
+    double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+    if (!pagePath.empty() && !topology.isPaging()) {
+        std::cerr << "Cannot write " << pagePath << "\n";
+        return 1;
+    }
+    Tool tool(toolRadius, toolHeight);
+    uint64_t initialVoxels = topology.countVoxels();
+    size_t initialBlocks = topology.blockCount();
+
+    uint64_t steps = 0;
+    float directionStep = Tool::defaultDirectionStep * step / Tool::defaultCenterStep;
+    auto startTime = std::chrono::steady_clock::now();
+    while (tool.moveToNextPosture(step, directionStep)) {
+        if (!pagePath.empty() && prefetch > 0) {
+            topology.prefetch(tool.upcomingShapes(prefetch, step, directionStep));
+        }
+        if (!topology.subtract(tool, mode)) {
+            std::cerr << "Cannot read back a block paged out to " << pagePath << "\n";
+            return 1;
+        }
+        if (compacting) {
+            topology.compact();
+        }
+        ++steps;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    uint64_t finalVoxels = topology.countVoxels();
+    const PagingStats& paging = topology.pagingStats();
+    auto pools = Topology<>::poolStats();
+
+    std::cout << "steps:          " << steps << "\n"
+              << "wall time:      " << seconds << " s\n"
+              << "steps/s:        " << (seconds > 0 ? steps / seconds : 0.0) << "\n"
+              << "voxel size:     " << topology.voxelSize() << "\n"
+              << "stock built in: " << buildSeconds * 1e3 << " ms\n"
+              << "initial voxels: " << initialVoxels << "\n"
+              << "final voxels:   " << finalVoxels << "\n"
+              << "removed voxels: " << initialVoxels - finalVoxels << "\n"
+              << "blocks:         " << initialBlocks << " initial, " << topology.blockCount() << " final, " << topology.nodeBlockCount() << " cut into\n"
+              << "internal nodes: " << pools.internalNodes.live << " live, " << pools.internalNodes.highWater << " peak\n"
+              << "bricks:         " << pools.bricks.live << " live, " << pools.bricks.highWater << " peak\n";
+    if (!pagePath.empty()) {
+        std::cout << "paging:         " << paging.hitRate() * 100 << "% hit rate, " << paging.hits << " hits, " << paging.prefetched << " prefetched, "
+                  << paging.misses << " misses, " << paging.readErrors << " read errors, " << paging.stallSeconds * 1e3 << " ms stalled\n"
+                  << "paged blocks:   " << topology.pagedBlockCount() << " now, " << paging.evictions << " evictions, " << paging.bytesWritten / 1048576.0
+                  << " MB written, " << paging.bytesRead / 1048576.0 << " MB read\n"
+                  << "resident:       " << paging.residentBytes / 1048576.0 << " MB, " << paging.peakResidentBytes / 1048576.0 << " MB peak\n";
+    }
+    return 0;
+}
+
+// Reads snapshots at a fixed rate while the simulation thread removes the postures.
+static int runViewer(float length, float width, float height, float toolRadius, float toolHeight, float rate)
+{
+    Simulation simulation(length, width, height, toolRadius, toolHeight);
+    auto frame = std::chrono::duration<double>(1.0 / rate);
+    uint64_t frames = 0, fresh = 0;
+    size_t leaves = 0;
+    double pickupSeconds = 0.0;
+    auto startTime = std::chrono::steady_clock::now();
+    simulation.start();
+    while (true) {
+        auto frameStart = std::chrono::steady_clock::now();
+        bool running = simulation.isRunning();
+        if (simulation.update()) {
+            leaves = simulation.snapshot().coords.size();
+            ++fresh;
+        }
+        pickupSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - frameStart).count();
+        ++frames;
+        // The last snapshot is published before the simulation reports it stopped.
+        if (!running) {
+            break;
+        }
+        std::this_thread::sleep_until(frameStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(frame));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    SimulationStats stats = simulation.stats();
+
+    std::cout << "steps:          " << stats.steps << "\n"
+              << "wall time:      " << seconds << " s\n"
+              << "steps/s:        " << stats.stepsPerSecond << "\n"
+              << "snapshots:      " << stats.snapshots << " published, " << fresh << " drawn\n"
+              << "frames:         " << frames << ", " << pickupSeconds / frames * 1e3 << " ms per pickup\n"
+              << "surface leaves: " << leaves << "\n";
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    float length = 1000.0f, width = 1000.0f, height = 1000.0f;
+    float toolRadius = 50.0f, toolHeight = 200.0f;
+    bool pointMode = false;
+    SubtractMode mode = SubtractMode::Batch;
+    float step = Tool::defaultCenterStep;
+    bool sweep = false;
+    uint32_t batch = 1;
+    uint32_t threads = 0;
+    enum class Extract { None, Full, Incremental, Packed } extract = Extract::None;
+    Extraction extraction = Extraction::All;
+    uint32_t grain = Scheduler::instance().grainSize();
+    bool meshing = false;
+    MeshStyle meshStyle = MeshStyle::Quads;
+    std::string exportPath;
+    float viewerRate = 0.0f;
+    int64_t budget = 0;
+    std::string loadPath, savePath;
+    bool snapshots = false;
+    bool compacting = false;
+    bool pruning = false;
+    std::string journalPath, replayPath;
+    std::string metricsPath;
+    float sparseVoxelSize = 0.0f;
+    uint32_t fitVoxels = 0;
+    std::string pagePath;
+    uint64_t pageBudget = 256ull << 20;
+    uint32_t prefetch = 8;
+    uint64_t checkpointInterval = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--stock") == 0 && i + 3 < argc) {
+            length = std::strtof(argv[++i], nullptr);
+            width = std::strtof(argv[++i], nullptr);
+            height = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--tool") == 0 && i + 2 < argc) {
+            toolRadius = std::strtof(argv[++i], nullptr);
+            toolHeight = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "point") == 0) {
+                pointMode = true;
+            } else if (std::strcmp(argv[i], "batch") == 0) {
+                mode = SubtractMode::Batch;
+            } else if (std::strcmp(argv[i], "span") == 0) {
+                mode = SubtractMode::Span;
+            } else {
+                std::cerr << "Unknown mode: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+            step = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--sweep") == 0) {
+            sweep = true;
+        } else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = std::max(1u, (uint32_t)std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--extract") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "none") == 0) {
+                extract = Extract::None;
+            } else if (std::strcmp(argv[i], "full") == 0) {
+                extract = Extract::Full;
+            } else if (std::strcmp(argv[i], "incremental") == 0) {
+                extract = Extract::Incremental;
+            } else if (std::strcmp(argv[i], "packed") == 0) {
+                extract = Extract::Packed;
+            } else {
+                std::cerr << "Unknown extraction: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--surface") == 0) {
+            extraction = Extraction::Surface;
+        } else if (std::strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            ++i;
+            meshing = true;
+            if (std::strcmp(argv[i], "quads") == 0) {
+                meshStyle = MeshStyle::Quads;
+            } else if (std::strcmp(argv[i], "smooth") == 0) {
+                meshStyle = MeshStyle::Smooth;
+            } else {
+                std::cerr << "Unknown mesh style: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            exportPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            loadPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--prune") == 0) {
+            pruning = true;
+        } else if (std::strcmp(argv[i], "--compact") == 0) {
+            compacting = true;
+        } else if (std::strcmp(argv[i], "--snapshots") == 0) {
+            snapshots = true;
+        } else if (std::strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            journalPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            metricsPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpointInterval = std::strtoull(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--sparse") == 0 && i + 1 < argc) {
+            sparseVoxelSize = std::strtof(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--fit") == 0 && i + 1 < argc) {
+            fitVoxels = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--page-file") == 0 && i + 1 < argc) {
+            pagePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--page-budget") == 0 && i + 1 < argc) {
+            pageBudget = (uint64_t)(std::strtod(argv[++i], nullptr) * 1048576.0);
+        } else if (std::strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            prefetch = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            budget = std::max(1ll, std::strtoll(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--viewer") == 0 && i + 1 < argc) {
+            viewerRate = std::max(1.0f, std::strtof(argv[++i], nullptr));
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--grain") == 0 && i + 1 < argc) {
+            grain = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--help") == 0) {
+            printUsage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown or incomplete option: " << argv[i] << "\n";
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    Scheduler::instance().setThreadCount(threads);
+    Scheduler::instance().setGrainSize(grain);
+
+    if (viewerRate > 0) {
+        return runViewer(length, width, height, toolRadius, toolHeight, viewerRate);
+    }
+    if (!replayPath.empty()) {
+        return runReplay(replayPath);
+    }
+    if (sparseVoxelSize > 0 || fitVoxels > 0) {
+        VoxelResolution resolution = sparseVoxelSize > 0 ? VoxelResolution::physical(sparseVoxelSize) : VoxelResolution::fitToBox(fitVoxels);
+        return runSparse(length, width, height, resolution, toolRadius, toolHeight, step, pointMode ? SubtractMode::Batch : mode, pagePath, pageBudget, prefetch, compacting);
+    }
+
+    Topology<> topology(length, width, height);
+    Tool tool(toolRadius, toolHeight);
+    auto isInside = [&](const Vector3D<float>& p) {
+        return tool.isInside(p);
+    };
+
+    if (!loadPath.empty()) {
+        auto loadStart = std::chrono::steady_clock::now();
+        MappedTopology<> file;
+        if (!file.open(loadPath)) {
+            std::cerr << "Cannot read " << loadPath << "\n";
+            return 1;
+        }
+        auto mapped = std::chrono::steady_clock::now();
+        if (!topology.load(file)) {
+            std::cerr << loadPath << " was saved from a stock of " << file.length() << " x " << file.width() << " x " << file.height() << "\n";
+            return 1;
+        }
+        auto loaded = std::chrono::steady_clock::now();
+        std::cout << "loaded:         " << loadPath << ", mapped in " << std::chrono::duration<double, std::milli>(mapped - loadStart).count()
+                  << " ms, copied in " << std::chrono::duration<double, std::milli>(loaded - mapped).count() << " ms\n";
+    }
+
+    // Declared after the tree, so that the checkpoints still queued are written before it goes.
+    JournalWriter journal;
+    if (!journalPath.empty() && !topology.startJournal(journal, journalPath, checkpointInterval)) {
+        std::cerr << "Cannot write " << journalPath << "\n";
+        return 1;
+    }
+
+    if (!metricsPath.empty()) {
+        topology.startMetrics();
+    }
+
+    uint64_t initialVoxels = topology.countVoxels();
+
+    uint64_t steps = 0;
+    auto startTime = std::chrono::steady_clock::now();
+    float directionStep = Tool::defaultDirectionStep * step / Tool::defaultCenterStep;
+    Capsule3D<float> previous = tool.getShape();
+    std::vector<Capsule3D<float>> postures;
+    std::vector<Vector3D<float>> coords;
+    std::vector<float> sizes;
+    VoxelSegments segments;
+    PackedVoxels<Topology<>::PackedCoord> packed;
+    double extractSeconds = 0.0;
+    MeshCache meshes(meshStyle);
+    double meshSeconds = 0.0;
+    std::vector<Topology<>::Snapshot> history;
+    std::vector<uint64_t> historyVoxels;
+    uint64_t ticks = 0;
+    double tickSeconds = 0.0, longestTick = 0.0;
+    double compactSeconds = 0.0, pruneSeconds = 0.0;
+    auto extractLeaves = [&] {
+        auto extractStart = std::chrono::steady_clock::now();
+        if (extract == Extract::Full) {
+            topology.calculateVoxels(coords, sizes, extraction);
+        } else if (extract == Extract::Incremental) {
+            topology.calculateVoxels(segments, extraction);
+        } else if (extract == Extract::Packed) {
+            topology.calculateVoxels(packed);
+        }
+        extractSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - extractStart).count();
+        if (meshing) {
+            auto meshStart = std::chrono::steady_clock::now();
+            topology.calculateMesh(meshes);
+            meshSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - meshStart).count();
+        }
+    };
+    auto keepSnapshot = [&] {
+        if (snapshots) {
+            history.push_back(topology.snapshot());
+            historyVoxels.push_back(topology.countVoxels());
+        }
+    };
+    extractLeaves();
+    keepSnapshot();
+    while (tool.moveToNextPosture(step, directionStep)) {
+        if (batch > 1 && !pointMode && !sweep) {
+            postures.push_back(tool.getShape());
+            if (postures.size() == batch) {
+                topology.subtract(postures, mode);
+                postures.clear();
+            }
+        } else if (sweep && !tool.isLastMoveRapid()) {
+            topology.subtractSweep(previous, tool.getShape(), mode);
+        } else if (pointMode) {
+            topology.subtract(tool.getBBox(), isInside);
+        } else if (budget > 0) {
+            topology.beginSubtract(tool, mode);
+            while (topology.pendingBricks() > 0) {
+                auto tickStart = std::chrono::steady_clock::now();
+                topology.resumeSubtract({ std::chrono::microseconds(budget) });
+                double tick = std::chrono::duration<double>(std::chrono::steady_clock::now() - tickStart).count();
+                tickSeconds += tick;
+                longestTick = std::max(longestTick, tick);
+                ++ticks;
+            }
+        } else {
+            topology.subtract(tool, mode);
+        }
+        previous = tool.getShape();
+        ++steps;
+        if (pruning) {
+            auto pruneStart = std::chrono::steady_clock::now();
+            topology.prune();
+            pruneSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - pruneStart).count();
+        }
+        if (compacting) {
+            auto compactStart = std::chrono::steady_clock::now();
+            topology.compact();
+            compactSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - compactStart).count();
+        }
+        extractLeaves();
+        keepSnapshot();
+    }
+    if (!postures.empty()) {
+        topology.subtract(postures, mode);
+        extractLeaves();
+    }
+    auto endTime = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(endTime - startTime).count();
+    uint64_t finalVoxels = topology.countVoxels();
+    float voxelSize = topology.voxelSize();
+    auto pools = topology.poolStats();
+    auto scheduler = Scheduler::instance().stats();
+    BrickStorageStats storage = topology.brickStorage();
+
+    std::cout << "steps:          " << steps << "\n"
+              << "wall time:      " << seconds << " s\n"
+              << "threads:        " << Scheduler::instance().threadCount() << "\n"
+              << "steps/s:        " << (seconds > 0 ? steps / seconds : 0.0) << "\n"
+              << "voxel size:     " << voxelSize << "\n"
+              << "initial voxels: " << initialVoxels << "\n"
+              << "final voxels:   " << finalVoxels << "\n"
+              << "removed voxels: " << initialVoxels - finalVoxels << "\n"
+              << "internal nodes: " << pools.internalNodes.live << " live, " << pools.internalNodes.highWater << " peak\n"
+              << "bricks:         " << pools.bricks.live << " live, " << pools.bricks.highWater << " peak\n"
+              << "brick storage:  " << storage.tiles << " tiles, " << storage.dense << " dense, " << storage.sparse << " sparse, " << storage.runs << " runs, "
+              << storage.inactive << " removed, " << storage.bytes / 1024 << " KiB\n"
+              << "tasks:          " << scheduler.tasks << ", " << scheduler.steals << " stolen\n";
+    if (extract != Extract::None) {
+        size_t leaves = extract == Extract::Full ? coords.size()
+            : extract == Extract::Packed         ? packed.size()
+                                                 : segments.leafCount();
+        std::cout << "extraction:     " << extractSeconds << " s, " << leaves << " leaves";
+        if (extract == Extract::Incremental) {
+            std::cout << " in " << segments.segments().size() << " segments";
+        }
+        std::cout << "\n";
+    }
+    if (snapshots) {
+        // Every snapshot is restored once, newest first, and checked against the count taken with it.
+        uint64_t mismatches = 0;
+        auto rewindStart = std::chrono::steady_clock::now();
+        for (size_t i = history.size(); i-- > 0;) {
+            topology.restore(history[i]);
+            mismatches += topology.countVoxels() != historyVoxels[i];
+        }
+        double rewindSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - rewindStart).count();
+        std::cout << "snapshots:      " << history.size() << ", " << rewindSeconds / history.size() * 1e3 << " ms per restore and count, "
+                  << mismatches << " mismatches\n";
+        if (mismatches > 0) {
+            std::cerr << "Restored snapshots do not match their voxel counts\n";
+            return 1;
+        }
+        topology.restore(history.back());
+    }
+    if (!journalPath.empty()) {
+        auto flushStart = std::chrono::steady_clock::now();
+        journal.close();
+        double flushSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - flushStart).count();
+        if (journal.failed()) {
+            std::cerr << "Cannot write " << journalPath << "\n";
+            return 1;
+        }
+        std::cout << "journal:        " << topology.journalSteps() << " steps, " << journal.bytesWritten() / 1024 << " KiB, "
+                  << flushSeconds * 1e3 << " ms to finish writing\n";
+        topology.stopJournal();
+    }
+    if (!metricsPath.empty()) {
+        // Voxel volume in cubic stock units, so the removed column reads as material removed per step.
+        const std::vector<StepMetrics>& metrics = topology.metrics();
+        const double voxelVolume = (double)voxelSize * voxelSize * voxelSize;
+        std::ofstream out(metricsPath);
+        out << "step,removed_voxels,removed_volume,engaged_voxels,bricks\n";
+        StepMetrics peak;
+        for (size_t i = 0; i < metrics.size(); ++i) {
+            const StepMetrics& m = metrics[i];
+            out << i + 1 << ',' << m.removedVoxels << ',' << m.removedVoxels * voxelVolume << ',' << m.engagedVoxels << ',' << m.bricks << '\n';
+            peak.removedVoxels = std::max(peak.removedVoxels, m.removedVoxels);
+            peak.engagedVoxels = std::max(peak.engagedVoxels, m.engagedVoxels);
+        }
+        if (!out) {
+            std::cerr << "Cannot write " << metricsPath << "\n";
+            return 1;
+        }
+        std::cout << "metrics:        " << metrics.size() << " steps, " << peak.removedVoxels << " removed and " << peak.engagedVoxels
+                  << " engaged voxels at most, written to " << metricsPath << "\n";
+    }
+    if (pruning) {
+        std::cout << "pruning:        " << pruneSeconds << " s\n";
+    }
+    if (compacting) {
+        std::cout << "compaction:     " << compactSeconds << " s\n";
+    }
+    if (budget > 0) {
+        std::cout << "ticks:          " << ticks << ", " << (ticks > 0 ? tickSeconds / ticks * 1e3 : 0.0) << " ms mean, "
+                  << longestTick * 1e3 << " ms longest\n";
+    }
+    if (meshing) {
+        std::cout << "meshing:        " << meshSeconds << " s, " << meshes.triangleCount() << " triangles in "
+                  << meshes.meshes().size() << " meshes\n";
+    }
+    if (!savePath.empty()) {
+        if (!topology.save(savePath)) {
+            std::cerr << "Cannot write " << savePath << "\n";
+            return 1;
+        }
+        std::cout << "saved:          " << savePath << "\n";
+    }
+    if (!exportPath.empty()) {
+        if (!meshing) {
+            topology.calculateMesh(meshes);
+        }
+        Mesh mesh;
+        meshes.gather(mesh);
+        bool ply = exportPath.size() >= 4 && exportPath.compare(exportPath.size() - 4, 4, ".ply") == 0;
+        if (!(ply ? mesh.savePLY(exportPath) : mesh.saveSTL(exportPath))) {
+            std::cerr << "Cannot write " << exportPath << "\n";
+            return 1;
+        }
+        std::cout << "exported:       " << exportPath << ", " << mesh.triangleCount() << " triangles\n";
+    }
+    return 0;
+}